@@ -0,0 +1,218 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+// Small harness shared by huge_memory_bench.cpp and the devirtualisation
+// benchmarks, so bench_runner can run cases of both suites the same way:
+// parameter sweeps, warmup and measured iterations, steady_clock and TSC
+// timing, one JSON document at the end.
+//
+// A case registers itself with a static harness::Register, next to the code
+// it measures, and gets called once per combination of its parameters. It
+// sets things up, then loops on State::next(), which times every iteration:
+//
+//   bool runFoo(harness::State &state)
+//   {
+//       Foo foo(state.intParam("size"));
+//       while (state.next())
+//           foo.run();
+//       return true;
+//   }
+//   static harness::Register registerFoo(
+//       {"suite/foo", "What foo measures", {{"size", "16,64"}}, runFoo});
+//
+// Default parameter values are comma separated lists, every combination is
+// run unless bench_runner --set overrides them.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace harness {
+
+// Summary of the values of one metric over every iteration (or run)
+struct Stats {
+    double min = 0, median = 0, p99 = 0, mean = 0;
+};
+
+inline Stats computeStats(std::vector<double> values)
+{
+    Stats stats;
+    if (values.empty())
+        return stats;
+    std::sort(values.begin(), values.end());
+    const size_t n = values.size();
+    stats.min = values[0];
+    stats.median = n % 2 ? values[n / 2]
+                         : (values[n / 2 - 1] + values[n / 2]) / 2;
+    // Nearest rank
+    stats.p99 = values[(size_t) std::ceil(0.99 * n) - 1];
+    for (double value : values)
+        stats.mean += value;
+    stats.mean /= n;
+    return stats;
+}
+
+inline std::string jsonString(const std::string &str)
+{
+    std::string out = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// TSC, ordered after the work that came before it. 0 where there is no TSC.
+inline uint64_t readTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    return __rdtscp(&aux);
+#else
+    return 0;
+#endif
+}
+
+typedef std::map<std::string, std::string> Params;
+
+// One metric of a case, one value per measured iteration
+typedef std::vector<std::pair<std::string, std::vector<double>>> Metrics;
+
+// What a case sees of the harness: its parameters and the iteration loop
+class State {
+  public:
+    State(const Params &params, unsigned long warmup, unsigned long iterations)
+        : params(params), warmup(warmup), iterations(iterations)
+    {
+    }
+
+    // Value of a parameter, empty if the case doesn't have it
+    const std::string &param(const std::string &name) const
+    {
+        static const std::string empty;
+        const auto it = params.find(name);
+        return it == params.end() ? empty : it->second;
+    }
+    long intParam(const std::string &name) const
+    {
+        return strtol(param(name).c_str(), nullptr, 0);
+    }
+    double doubleParam(const std::string &name) const
+    {
+        return strtod(param(name).c_str(), nullptr);
+    }
+
+    // Ends the iteration in progress if any and starts the next one, false
+    // once every warmup and measured iteration has run. Only the measured
+    // ones get their time and what record() got added to the metrics.
+    bool next()
+    {
+        const uint64_t tsc = readTsc();
+        const auto now = std::chrono::steady_clock::now();
+        if (started) {
+            if (done >= warmup) {
+                const std::chrono::duration<double> secs = now - start;
+                add("secs", secs.count());
+                if (startTsc)
+                    add("cycles", double(tsc - startTsc));
+                if (items)
+                    add("ns_per_item", secs.count() * 1e9 / items);
+                for (const auto &value : pending)
+                    add(value.first, value.second);
+            }
+            ++done;
+        }
+        pending.clear();
+        if (done >= warmup + iterations)
+            return false;
+        started = true;
+        start = std::chrono::steady_clock::now();
+        startTsc = readTsc();
+        return true;
+    }
+
+    // Adds a value for the iteration in progress, e.g. the time of a phase
+    // the case timed itself
+    void record(const std::string &name, double value)
+    {
+        pending.emplace_back(name, value);
+    }
+
+    // Number of operations in an iteration, for ns_per_item
+    void setItems(double n)
+    {
+        items = n;
+    }
+
+    const Metrics &metrics() const
+    {
+        return results;
+    }
+
+  private:
+    void add(const std::string &name, double value)
+    {
+        for (auto &metric : results) {
+            if (metric.first == name) {
+                metric.second.push_back(value);
+                return;
+            }
+        }
+        results.emplace_back(name, std::vector<double>{value});
+    }
+
+    const Params &params;
+    const unsigned long warmup, iterations;
+    unsigned long done = 0;
+    bool started = false;
+    std::chrono::steady_clock::time_point start;
+    uint64_t startTsc = 0;
+    double items = 0;
+    std::vector<std::pair<std::string, double>> pending;
+    Metrics results;
+};
+
+struct Case {
+    const char *name;
+    const char *help;
+    // Parameters and their default values, comma separated to sweep
+    Params defaults;
+    // False (after printing why) if the case can't run with these params
+    bool (*run)(State &state);
+};
+
+inline std::vector<Case> &registry()
+{
+    static std::vector<Case> cases;
+    return cases;
+}
+
+struct Register {
+    explicit Register(const Case &benchCase)
+    {
+        registry().push_back(benchCase);
+    }
+};
+
+} // namespace harness
+
+#endif
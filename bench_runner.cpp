@@ -0,0 +1,319 @@
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <sys/utsname.h>
+
+#include "bench_harness.h"
+
+// README:
+// Runs the cases huge_memory_bench.cpp and the devirtualisation benchmarks
+// register (see bench_harness.h) with the same warmup, iterations, pinning
+// and timing, so the numbers of a nightly run can be compared across both.
+//
+// Every case has parameters with default values, --list prints them. Values
+// are comma separated lists and every combination gets run:
+//   bench_runner --filter memory/ --set page=4k,thp,2m --set size_mib=256,4096
+// sweeps the page size and the array size of the memory access case. --set
+// only applies to the cases that have the parameter.
+//
+// Each combination runs --warmup iterations that don't count, then
+// --iterations measured ones, each timed with steady_clock (secs) and the TSC
+// (cycles), plus whatever the case records (phase times, ns per multiply...).
+// The text output has min/median/p99 per metric, --format json prints every
+// value on stdout with the host and the runner settings, the progress
+// messages of the cases go to stderr then.
+//
+// Build:
+// clang++/g++ -std=c++17 -Wall -W -g -O2 -pthread -DHUGE_MEMORY_BENCH_NO_MAIN
+//     -o bench_runner bench_runner.cpp huge_memory_bench.cpp
+//     devirtualisation/benchmark_cases.cc devirtualisation/benchmark_multiple_files.cc
+
+using namespace std;
+
+struct RunnerConfig {
+    vector<string> filters;
+    // --set name=values, in order, later ones win
+    vector<pair<string, string>> overrides;
+    unsigned long warmup = 1, iterations = 5;
+    int cpu = -1;
+    bool json = false;
+};
+
+// Results of one case with one combination of parameters
+struct CaseResult {
+    string name;
+    harness::Params params;
+    bool ok = false;
+    harness::Metrics metrics;
+};
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [--list] [--filter SUBSTRING]... [--set NAME=V1,V2...]...\n"
+           "        [--warmup N] [--iterations N] [--cpu CPU] "
+           "[--format text|json]\n"
+           "--list: print the cases and their parameters\n"
+           "--filter: only run the cases whose name contains SUBSTRING, can be\n"
+           "          repeated\n"
+           "--set: values of a parameter, every combination gets run\n"
+           "--warmup: iterations run before measuring, default 1\n"
+           "--iterations: measured iterations, default 5\n"
+           "--cpu: pin the runner (and the cases' main thread) to CPU\n"
+           "--format: json prints every value on stdout\n", argv0);
+    exit(1);
+}
+
+static vector<string> split(const string &str)
+{
+    vector<string> values;
+    size_t pos = 0;
+    for (;;) {
+        const size_t comma = str.find(',', pos);
+        values.push_back(str.substr(pos, comma - pos));
+        if (comma == string::npos)
+            return values;
+        pos = comma + 1;
+    }
+}
+
+// Every combination of values of the params of benchCase
+static vector<harness::Params> expand(const harness::Case &benchCase,
+                                      const RunnerConfig &config)
+{
+    harness::Params values = benchCase.defaults;
+    for (const auto &override : config.overrides) {
+        if (values.count(override.first))
+            values[override.first] = override.second;
+    }
+    vector<harness::Params> combinations(1);
+    for (const auto &param : values) {
+        vector<harness::Params> next;
+        for (const harness::Params &combination : combinations) {
+            for (const string &value : split(param.second)) {
+                next.push_back(combination);
+                next.back()[param.first] = value;
+            }
+        }
+        combinations.swap(next);
+    }
+    return combinations;
+}
+
+static string paramsString(const harness::Params &params)
+{
+    string out;
+    for (const auto &param : params)
+        out += (out.empty() ? "" : " ") + param.first + "=" + param.second;
+    return out;
+}
+
+static bool matches(const harness::Case &benchCase, const RunnerConfig &config)
+{
+    if (config.filters.empty())
+        return true;
+    for (const string &filter : config.filters) {
+        if (strstr(benchCase.name, filter.c_str()))
+            return true;
+    }
+    return false;
+}
+
+static void printJson(FILE *out, const RunnerConfig &config,
+                      const vector<CaseResult> &results)
+{
+    struct utsname uts;
+    uname(&uts);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"runner\": {\"warmup\": %lu, \"iterations\": %lu, "
+            "\"cpu\": %d},\n", config.warmup, config.iterations, config.cpu);
+    fprintf(out, "  \"host\": {\"nodename\": %s, \"release\": %s, "
+            "\"machine\": %s},\n", harness::jsonString(uts.nodename).c_str(),
+            harness::jsonString(uts.release).c_str(),
+            harness::jsonString(uts.machine).c_str());
+    fprintf(out, "  \"cases\": [\n");
+    for (size_t r = 0; r < results.size(); ++r) {
+        const CaseResult &result = results[r];
+        fprintf(out, "    {\n");
+        fprintf(out, "      \"name\": %s,\n",
+                harness::jsonString(result.name).c_str());
+        fprintf(out, "      \"params\": {");
+        size_t p = 0;
+        for (const auto &param : result.params) {
+            fprintf(out, "%s%s: %s", p++ ? ", " : "",
+                    harness::jsonString(param.first).c_str(),
+                    harness::jsonString(param.second).c_str());
+        }
+        fprintf(out, "},\n");
+        fprintf(out, "      \"ok\": %s,\n", result.ok ? "true" : "false");
+        fprintf(out, "      \"metrics\": {\n");
+        for (size_t m = 0; m < result.metrics.size(); ++m) {
+            const auto &metric = result.metrics[m];
+            const harness::Stats stats = harness::computeStats(metric.second);
+            fprintf(out, "        %s: {\"min\": %.9g, \"median\": %.9g, "
+                    "\"p99\": %.9g, \"mean\": %.9g, \"values\": [",
+                    harness::jsonString(metric.first).c_str(), stats.min,
+                    stats.median, stats.p99, stats.mean);
+            for (size_t v = 0; v < metric.second.size(); ++v)
+                fprintf(out, "%s%.9g", v ? ", " : "", metric.second[v]);
+            fprintf(out, "]}%s\n", m + 1 < result.metrics.size() ? "," : "");
+        }
+        fprintf(out, "      }\n");
+        fprintf(out, "    }%s\n", r + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+enum {
+    OPT_LIST = 256,
+    OPT_FILTER,
+    OPT_SET,
+    OPT_WARMUP,
+    OPT_ITERATIONS,
+    OPT_CPU,
+    OPT_FORMAT,
+};
+
+int main(int argc, char **argv)
+{
+    RunnerConfig config;
+    bool list = false;
+
+    static const struct option longOptions[] = {
+        {"list", no_argument, nullptr, OPT_LIST},
+        {"filter", required_argument, nullptr, OPT_FILTER},
+        {"set", required_argument, nullptr, OPT_SET},
+        {"warmup", required_argument, nullptr, OPT_WARMUP},
+        {"iterations", required_argument, nullptr, OPT_ITERATIONS},
+        {"cpu", required_argument, nullptr, OPT_CPU},
+        {"format", required_argument, nullptr, OPT_FORMAT},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", longOptions, nullptr)) != -1) {
+        char *endPtr;
+        switch (opt) {
+            case OPT_LIST:
+                list = true;
+                break;
+            case OPT_FILTER:
+                config.filters.push_back(optarg);
+                break;
+            case OPT_SET: {
+                const char *equal = strchr(optarg, '=');
+                if (!equal || equal == optarg || !equal[1]) {
+                    usage(argv[0]);
+                }
+                config.overrides.emplace_back(string(optarg, equal - optarg), equal + 1);
+                break;
+            }
+            case OPT_WARMUP:
+                config.warmup = strtoul(optarg, &endPtr, 0);
+                if (*endPtr) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_ITERATIONS:
+                config.iterations = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.iterations == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_CPU:
+                config.cpu = strtol(optarg, &endPtr, 0);
+                if (*endPtr || config.cpu < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_FORMAT:
+                if (!strcmp(optarg, "json")) {
+                    config.json = true;
+                } else if (strcmp(optarg, "text")) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    if (list) {
+        for (const harness::Case &benchCase : harness::registry()) {
+            printf("%s: %s\n", benchCase.name, benchCase.help);
+            printf("    %s\n", paramsString(benchCase.defaults).c_str());
+        }
+        return 0;
+    }
+
+    // Same as huge_memory_bench --format json: the JSON owns stdout
+    FILE *out = stdout;
+    if (config.json) {
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Can't redirect stdout");
+            return 1;
+        }
+    }
+
+    // Threads the cases start inherit the mask, unless they pin themselves
+    if (config.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            perror("Can't pin the runner");
+            return 1;
+        }
+    }
+
+    vector<CaseResult> results;
+    bool failed = false;
+    for (const harness::Case &benchCase : harness::registry()) {
+        if (!matches(benchCase, config))
+            continue;
+        for (const harness::Params &params : expand(benchCase, config)) {
+            printf("Running %s %s\n", benchCase.name,
+                   paramsString(params).c_str());
+            fflush(stdout);
+            CaseResult result;
+            result.name = benchCase.name;
+            result.params = params;
+            harness::State state(result.params, config.warmup,
+                                 config.iterations);
+            result.ok = benchCase.run(state);
+            result.metrics = state.metrics();
+            if (!result.ok) {
+                printf("%s failed\n", benchCase.name);
+                failed = true;
+            }
+            for (const auto &metric : result.metrics) {
+                const harness::Stats stats =
+                    harness::computeStats(metric.second);
+                printf("  %s: min %.6g, median %.6g, p99 %.6g\n",
+                       metric.first.c_str(), stats.min, stats.median,
+                       stats.p99);
+            }
+            results.push_back(result);
+        }
+    }
+    if (results.empty()) {
+        puts("No case matches the filters, see --list");
+        return 1;
+    }
+
+    if (config.json) {
+        printJson(out, config, results);
+    }
+    fflush(out);
+    return failed;
+}
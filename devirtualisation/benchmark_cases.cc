@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "../bench_harness.h"
+#include "benchmark_multiple_files.h"
+
+// The modes of benchmark_multiple_files_main.cc that bench_runner sweeps,
+// through the same Matrix API. Every iteration is a chain of multiplies, and
+// ns_per_item is the time of one multiply.
+
+// Kernel, storage and size from the params, and the number of multiplies,
+// scaled like the main so every size does the same flops
+static bool setup(harness::State& state, int* n, long* l) {
+    constexpr int N = 16;
+    constexpr long L = 1000 * 1000;
+    *n = int(state.intParam("size"));
+    *l = state.intParam("multiplies");
+    if (*l <= 0 && *n > 0) {
+        *l = std::max(1L, long(double(L) * N * N * N / (double(*n) * *n * *n)));
+    }
+    if (*n <= 0 || !set_multiply_kernel(state.param("kernel").c_str())
+     || !set_matrix_storage(state.param("storage").c_str())) {
+        fprintf(stderr, "Bad size, unknown or unsupported kernel, or unknown storage\n");
+        return false;
+    }
+    state.setItems(double(*l));
+    return true;
+}
+
+static bool run_copy(harness::State& state) {
+    int n;
+    long l;
+    if (!setup(state, &n, &l)) {
+        return false;
+    }
+    auto a = Matrix::getRandom(n, n);
+    while (state.next()) {
+        Matrix res = a;
+        for (long i = 0; i < l; ++i) {
+            res = static_cast<const Matrix&>(res * a);
+        }
+        state.record("checksum", res[0][0]);
+    }
+    return true;
+}
+
+static bool run_move(harness::State& state) {
+    int n;
+    long l;
+    if (!setup(state, &n, &l)) {
+        return false;
+    }
+    auto a = Matrix::getRandom(n, n);
+    while (state.next()) {
+        Matrix res = a;
+        for (long i = 0; i < l; ++i) {
+            res = res * a;
+        }
+        state.record("checksum", res[0][0]);
+    }
+    return true;
+}
+
+static bool run_into(harness::State& state) {
+    int n;
+    long l;
+    if (!setup(state, &n, &l)) {
+        return false;
+    }
+    auto a = Matrix::getRandom(n, n);
+    Matrix tmp(n, n);
+    while (state.next()) {
+        Matrix res = a;
+        for (long i = 0; i < l; ++i) {
+            multiply_into(tmp, res, a);
+            std::swap(res, tmp);
+        }
+        state.record("checksum", res[0][0]);
+    }
+    return true;
+}
+
+static bool run_fixed(harness::State& state) {
+    constexpr int N = 16;
+    const long l = std::max(1L, state.intParam("multiplies"));
+    state.setItems(double(l));
+    auto a = FixedMatrix<N, N>::getRandom();
+    while (state.next()) {
+        FixedMatrix<N, N> res = a;
+        for (long i = 0; i < l; ++i) {
+            res = res * a;
+        }
+        state.record("checksum", res[0][0]);
+    }
+    return true;
+}
+
+static const harness::Params matrix_params = {
+    {"kernel", "naive"}, {"storage", "malloc"}, {"size", "16"}, {"multiplies", "0"},
+};
+
+static harness::Register register_copy(
+    {"devirt/copy", "Temporary plus copy assignment per multiply", matrix_params, run_copy});
+static harness::Register register_move(
+    {"devirt/move", "Temporary moved into the result", matrix_params, run_move});
+static harness::Register register_into(
+    {"devirt/into", "multiply_into between two buffers", matrix_params, run_into});
+static harness::Register register_fixed(
+    {"devirt/fixed", "FixedMatrix<16, 16>, compile-time sizes", {{"multiplies", "1000000"}},
+     run_fixed});
@@ -1,13 +1,194 @@
 #include "benchmark_multiple_files.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
 #include <stdexcept>
 #include <random>
+#include <utility>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "../huge_page_arena.h"
+
+// Where Matrix gets its elements from, to see how much of the benchmark is
+// really allocator and TLB cost:
+//   malloc: new[] and delete[] every time (the default)
+//   pool: per thread free lists keyed by size on top of new[]
+//   huge: the same free lists carving from a per thread arena of huge pages
+enum class Storage { Malloc, Pool, Huge };
+static Storage matrix_storage = Storage::Malloc;
+
+// Freed buffers by number of elements. There are only a couple of sizes in
+// flight, a linear search beats hashing.
+struct SizePool {
+    std::vector<std::pair<size_t, std::vector<double*>>> lists;
+
+    std::vector<double*>& list(size_t size) {
+        for (auto& entry : lists) {
+            if (entry.first == size) {
+                return entry.second;
+            }
+        }
+        lists.emplace_back(size, std::vector<double*>());
+        return lists.back().second;
+    }
+
+    double* take(size_t size) {
+        std::vector<double*>& free = list(size);
+        if (free.empty()) {
+            return nullptr;
+        }
+        double* arr = free.back();
+        free.pop_back();
+        return arr;
+    }
+};
+
+struct MallocPool : SizePool {
+    ~MallocPool() {
+        for (auto& entry : lists) {
+            for (double* arr : entry.second) {
+                delete[] arr;
+            }
+        }
+    }
+};
+
+// 1GiB of address space from huge_page_arena.h, 2MiB aligned and madvised
+// so THP backs it. Only the part we carve out gets faulted in.
+struct HugeArena : SizePool {
+    static constexpr size_t SIZE = 1UL << 30;
+    hugepages::HugePageArena arena{SIZE, options()};
+
+    static hugepages::Options options() {
+        hugepages::Options options = hugepages::HugePageArena::defaultOptions();
+        options.kind = hugepages::PAGE_THP;
+        return options;
+    }
+
+    double* carve(size_t size) {
+        return (double*) arena.allocate(size * sizeof(double), 64);
+    }
+};
+
+// Matrices move between threads (chains built on pool workers are destroyed
+// in main), so a buffer can be released on a thread that didn't carve it, or
+// after that thread is gone. Arenas are never unmapped: every one is in
+// huge_arenas, which only grows and is read without locking, and the arena of
+// a thread that exits goes to the next thread that needs one, free lists
+// included.
+constexpr int MAX_HUGE_ARENAS = 1024;
+static std::atomic<HugeArena*> huge_arenas[MAX_HUGE_ARENAS];
+static std::atomic<int> num_huge_arenas{0};
+static std::mutex idle_huge_arenas_lock;
+static std::vector<HugeArena*> idle_huge_arenas;
+
+static bool is_huge_arena_memory(const double* arr) {
+    const int count = std::min(num_huge_arenas.load(std::memory_order_acquire), MAX_HUGE_ARENAS);
+    for (int i = 0; i < count; ++i) {
+        const HugeArena* arena = huge_arenas[i].load(std::memory_order_acquire);
+        if (arena && arena->arena.owns(arr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The arena of the calling thread, null if there are too many already
+struct HugeArenaHandle {
+    HugeArena* arena = nullptr;
+
+    HugeArena* get() {
+        if (arena) {
+            return arena;
+        }
+        {
+            std::lock_guard<std::mutex> guard(idle_huge_arenas_lock);
+            if (!idle_huge_arenas.empty()) {
+                arena = idle_huge_arenas.back();
+                idle_huge_arenas.pop_back();
+                return arena;
+            }
+        }
+        const int slot = num_huge_arenas.fetch_add(1);
+        if (slot >= MAX_HUGE_ARENAS) {
+            return nullptr;
+        }
+        arena = new HugeArena;
+        huge_arenas[slot].store(arena, std::memory_order_release);
+        return arena;
+    }
+
+    ~HugeArenaHandle() {
+        if (arena) {
+            std::lock_guard<std::mutex> guard(idle_huge_arenas_lock);
+            idle_huge_arenas.push_back(arena);
+        }
+    }
+};
+
+static thread_local MallocPool malloc_pool;
+static thread_local HugeArenaHandle huge_arena;
+
+double* allocate_elements(size_t size) {
+    double* arr = nullptr;
+    if (matrix_storage == Storage::Pool) {
+        arr = malloc_pool.take(size);
+    } else if (matrix_storage == Storage::Huge) {
+        if (HugeArena* arena = huge_arena.get()) {
+            arr = arena->take(size);
+            if (!arr) {
+                arr = arena->carve(size);
+            }
+        }
+    }
+    // The arena can run out, new[] is always there
+    return arr ? arr : new double[size];
+}
+
+// Arena buffers go to the free lists of the calling thread's arena, whichever
+// arena they come from, the others were new[]ed: they go to the pool or get
+// deleted, whatever the storage is now
+void release_elements(double* arr, size_t size) {
+    if (arr == nullptr) {
+        return;
+    }
+    // No arena was ever made with malloc or pool storage, skip the scan
+    if (num_huge_arenas.load(std::memory_order_relaxed) != 0 && is_huge_arena_memory(arr)) {
+        // Leaked rather than delete[]d if this thread can't get an arena
+        HugeArena* arena = huge_arena.get();
+        if (arena) {
+            arena->list(size).push_back(arr);
+        }
+    } else if (matrix_storage == Storage::Pool) {
+        malloc_pool.list(size).push_back(arr);
+    } else {
+        delete[] arr;
+    }
+}
+
+bool set_matrix_storage(const char* name) {
+    if (!strcmp(name, "malloc")) {
+        matrix_storage = Storage::Malloc;
+    } else if (!strcmp(name, "pool")) {
+        matrix_storage = Storage::Pool;
+    } else if (!strcmp(name, "huge")) {
+        matrix_storage = Storage::Huge;
+    } else {
+        return false;
+    }
+    return true;
+}
 
 Matrix::Matrix(int n_, int m_)
 : n(n_)
 , m(m_)
 {
-    arr = new double[n * m];
+    arr = allocate_elements(size_t(n) * m);
 }
 
 Matrix::Matrix(const Matrix& other)
@@ -19,8 +200,16 @@ Matrix::Matrix(const Matrix& other)
     }
 }
 
+Matrix::Matrix(Matrix&& other) noexcept
+: n(other.n)
+, m(other.m)
+, arr(other.arr)
+{
+    other.arr = nullptr;
+}
+
 Matrix::~Matrix() {
-    delete[] arr;
+    release_elements(arr, size_t(n) * m);
     arr = nullptr;
 }
 
@@ -29,12 +218,10 @@ double* Matrix::operator[](int subscript) const {
 }
 
 Matrix& Matrix::operator=(const Matrix& other) {
+	release_elements(arr, size_t(n) * m);
 	n = other.n;
 	m = other.m;
-	if (arr != nullptr) {
-		delete[] arr;
-	}
-	arr = new double[n * m];
+	arr = allocate_elements(size_t(n) * m);
 	for (int i = 0; i < n; ++i) {
 		for (int j = 0; j < m; ++j) {
 			arr[i * m + j] = other[i][j];
@@ -43,6 +230,13 @@ Matrix& Matrix::operator=(const Matrix& other) {
 	return *this;
 }
 
+Matrix& Matrix::operator=(Matrix&& other) noexcept {
+    std::swap(n, other.n);
+    std::swap(m, other.m);
+    std::swap(arr, other.arr);
+    return *this;
+}
+
 Matrix Matrix::getRandom(int n, int m) {
     std::random_device rd;
     std::mt19937_64 mt(rd());
@@ -61,11 +255,147 @@ Matrix Matrix::getRandom(int n, int m) {
     return result;
 }
 
+// The multiply kernels, out = a * b with a n x m and b m x p. out doesn't
+// alias a or b, which the compiler gets told through __restrict.
+
+// i-k-j order: the inner loop updates a whole row of out with a row of b,
+// which vectorizes without reassociating the sums.
+void multiply_ikj(double* __restrict out, const double* __restrict a,
+                  const double* __restrict b, int n, int m, int p) {
+    for (int i = 0; i < n; ++i) {
+        double* __restrict row = out + i * p;
+        for (int j = 0; j < p; ++j) {
+            row[j] = 0;
+        }
+        for (int k = 0; k < m; ++k) {
+            const double aik = a[i * m + k];
+            const double* __restrict bk = b + k * p;
+            for (int j = 0; j < p; ++j) {
+                row[j] += aik * bk[j];
+            }
+        }
+    }
+}
+
+// Blocks of b the register-blocked kernels work on, KC x NC doubles (256kB)
+// so they stay in L2 while every row block of a goes over them.
+constexpr int KC = 128;
+constexpr int NC = 256;
+
+// 4 rows x 8 columns of out kept in 8 ymm registers while going down k.
+__attribute__((target("avx2,fma")))
+void multiply_avx2(double* __restrict out, const double* __restrict a,
+                   const double* __restrict b, int n, int m, int p) {
+    if (n % 4 || p % 8) {
+        multiply_ikj(out, a, b, n, m, p);
+        return;
+    }
+    std::fill(out, out + n * p, 0.0);
+    for (int kk = 0; kk < m; kk += KC) {
+        const int kend = std::min(kk + KC, m);
+        for (int jj = 0; jj < p; jj += NC) {
+            const int jend = std::min(jj + NC, p);
+            for (int i = 0; i < n; i += 4) {
+                for (int j = jj; j < jend; j += 8) {
+                    __m256d acc[4][2];
+                    for (int r = 0; r < 4; ++r) {
+                        acc[r][0] = _mm256_loadu_pd(out + (i + r) * p + j);
+                        acc[r][1] = _mm256_loadu_pd(out + (i + r) * p + j + 4);
+                    }
+                    for (int k = kk; k < kend; ++k) {
+                        const __m256d b0 = _mm256_loadu_pd(b + k * p + j);
+                        const __m256d b1 = _mm256_loadu_pd(b + k * p + j + 4);
+                        for (int r = 0; r < 4; ++r) {
+                            const __m256d air = _mm256_broadcast_sd(a + (i + r) * m + k);
+                            acc[r][0] = _mm256_fmadd_pd(air, b0, acc[r][0]);
+                            acc[r][1] = _mm256_fmadd_pd(air, b1, acc[r][1]);
+                        }
+                    }
+                    for (int r = 0; r < 4; ++r) {
+                        _mm256_storeu_pd(out + (i + r) * p + j, acc[r][0]);
+                        _mm256_storeu_pd(out + (i + r) * p + j + 4, acc[r][1]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Same with 4 rows x 16 columns in 8 zmm registers.
+__attribute__((target("avx512f")))
+void multiply_avx512(double* __restrict out, const double* __restrict a,
+                     const double* __restrict b, int n, int m, int p) {
+    if (n % 4 || p % 16) {
+        multiply_ikj(out, a, b, n, m, p);
+        return;
+    }
+    std::fill(out, out + n * p, 0.0);
+    for (int kk = 0; kk < m; kk += KC) {
+        const int kend = std::min(kk + KC, m);
+        for (int jj = 0; jj < p; jj += NC) {
+            const int jend = std::min(jj + NC, p);
+            for (int i = 0; i < n; i += 4) {
+                for (int j = jj; j < jend; j += 16) {
+                    __m512d acc[4][2];
+                    for (int r = 0; r < 4; ++r) {
+                        acc[r][0] = _mm512_loadu_pd(out + (i + r) * p + j);
+                        acc[r][1] = _mm512_loadu_pd(out + (i + r) * p + j + 8);
+                    }
+                    for (int k = kk; k < kend; ++k) {
+                        const __m512d b0 = _mm512_loadu_pd(b + k * p + j);
+                        const __m512d b1 = _mm512_loadu_pd(b + k * p + j + 8);
+                        for (int r = 0; r < 4; ++r) {
+                            const __m512d air = _mm512_set1_pd(a[(i + r) * m + k]);
+                            acc[r][0] = _mm512_fmadd_pd(air, b0, acc[r][0]);
+                            acc[r][1] = _mm512_fmadd_pd(air, b1, acc[r][1]);
+                        }
+                    }
+                    for (int r = 0; r < 4; ++r) {
+                        _mm512_storeu_pd(out + (i + r) * p + j, acc[r][0]);
+                        _mm512_storeu_pd(out + (i + r) * p + j + 8, acc[r][1]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+using MultiplyKernel = void (*)(double* __restrict, const double* __restrict,
+                                const double* __restrict, int, int, int);
+
+// What operator* and multiply_into use. Null (naive, the default) keeps the
+// original loop inline in them, so the baseline doesn't pay an indirect call
+// per multiply.
+static MultiplyKernel multiply_kernel = nullptr;
+
+bool set_multiply_kernel(const char* name) {
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool avx512 = __builtin_cpu_supports("avx512f");
+    if (!strcmp(name, "auto")) {
+        multiply_kernel = avx512 ? multiply_avx512 : avx2 ? multiply_avx2 : multiply_ikj;
+    } else if (!strcmp(name, "naive")) {
+        multiply_kernel = nullptr;
+    } else if (!strcmp(name, "ikj")) {
+        multiply_kernel = multiply_ikj;
+    } else if (!strcmp(name, "avx2") && avx2) {
+        multiply_kernel = multiply_avx2;
+    } else if (!strcmp(name, "avx512") && avx512) {
+        multiply_kernel = multiply_avx512;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 Matrix operator*(const Matrix& a, const Matrix& b) {
     if (a.m != b.n) {
         throw std::invalid_argument("Attempting to multiply matrices but the sizes don't match!");
     }
     Matrix result(a.n, b.m);
+    if (multiply_kernel) {
+        multiply_kernel(result.arr, a.arr, b.arr, a.n, a.m, b.m);
+        return result;
+    }
     for (int i = 0; i < a.n; ++i) {
         for (int j = 0; j < b.m; ++j) {
             result[i][j] = 0;
@@ -77,3 +407,198 @@ Matrix operator*(const Matrix& a, const Matrix& b) {
     return result;
 }
 
+void multiply_into(Matrix& out, const Matrix& a, const Matrix& b) {
+    if (a.m != b.n) {
+        throw std::invalid_argument("Attempting to multiply matrices but the sizes don't match!");
+    }
+    if (out.n * out.m != a.n * b.m) {
+        out = Matrix(a.n, b.m);
+    }
+    out.n = a.n;
+    out.m = b.m;
+    if (multiply_kernel) {
+        multiply_kernel(out.arr, a.arr, b.arr, a.n, a.m, b.m);
+        return;
+    }
+    for (int i = 0; i < a.n; ++i) {
+        for (int j = 0; j < b.m; ++j) {
+            out[i][j] = 0;
+            for (int k = 0; k < a.m; ++k) {
+                out[i][j] += a[i][k] * b[k][j];
+            }
+        }
+    }
+}
+
+template <int N, int M>
+FixedMatrix<N, M>::~FixedMatrix() {}
+
+template <int N, int M>
+double* FixedMatrix<N, M>::operator[](int subscript) {
+    return arr.data() + subscript * M;
+}
+
+template <int N, int M>
+const double* FixedMatrix<N, M>::operator[](int subscript) const {
+    return arr.data() + subscript * M;
+}
+
+template <int N, int M>
+FixedMatrix<N, M> FixedMatrix<N, M>::getRandom() {
+    std::random_device rd;
+    std::mt19937_64 mt(rd());
+    std::uniform_real_distribution<> dis(0, 1);
+    FixedMatrix result;
+    for (int i = 0; i < N; ++i) {
+        double sum = 0;
+        for (int j = 0; j < M; ++j) {
+            result[i][j] = dis(mt);
+            sum += result[i][j];
+        }
+        for (int j = 0; j < M; ++j) {
+            result[i][j] /= sum;
+        }
+    }
+    return result;
+}
+
+// i-k-j order: the inner loop updates a whole row of the result, which
+// vectorizes without reassociating the sums.
+template <int N, int M, int P>
+FixedMatrix<N, P> operator*(const FixedMatrix<N, M>& a, const FixedMatrix<M, P>& b) {
+    FixedMatrix<N, P> result;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < P; ++j) {
+            result[i][j] = 0;
+        }
+        for (int k = 0; k < M; ++k) {
+            const double aik = a[i][k];
+            for (int j = 0; j < P; ++j) {
+                result[i][j] += aik * b[k][j];
+            }
+        }
+    }
+    return result;
+}
+
+template class FixedMatrix<16, 16>;
+template FixedMatrix<16, 16> operator*(const FixedMatrix<16, 16>& a, const FixedMatrix<16, 16>& b);
+
+double Dense::at(int i, int j) const {
+    return values[i * n + j];
+}
+
+void Dense::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        double sum = 0;
+        for (int j = 0; j < n; ++j) {
+            sum += values[i * n + j] * x[j];
+        }
+        y[i] = sum;
+    }
+}
+
+Dense Dense::random(int n, std::mt19937_64& mt) {
+    std::uniform_real_distribution<> dis(0, 1);
+    Dense result;
+    result.n = n;
+    result.values.resize(n * n);
+    for (double& value : result.values) {
+        value = dis(mt) / n;
+    }
+    return result;
+}
+
+double Diagonal::at(int i, int j) const {
+    return i == j ? values[i] : 0;
+}
+
+void Diagonal::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        y[i] = values[i] * x[i];
+    }
+}
+
+Diagonal Diagonal::random(int n, std::mt19937_64& mt) {
+    std::uniform_real_distribution<> dis(0, 1);
+    Diagonal result;
+    result.n = n;
+    result.values.resize(n);
+    for (double& value : result.values) {
+        value = dis(mt);
+    }
+    return result;
+}
+
+double Sparse::at(int i, int j) const {
+    for (int k = row_start[i]; k < row_start[i + 1]; ++k) {
+        if (columns[k] == j) {
+            return values[k];
+        }
+    }
+    return 0;
+}
+
+void Sparse::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        double sum = 0;
+        for (int k = row_start[i]; k < row_start[i + 1]; ++k) {
+            sum += values[k] * x[columns[k]];
+        }
+        y[i] = sum;
+    }
+}
+
+Sparse Sparse::random(int n, std::mt19937_64& mt) {
+    constexpr int PER_ROW = 3;
+    const int per_row = std::min(n, PER_ROW);
+    std::uniform_real_distribution<> dis(0, 1);
+    // Distinct columns in each row, sorted like CSR: the first per_row
+    // entries of a partial shuffle of 0..n-1, which stays a permutation from
+    // one row to the next
+    std::vector<int> permutation(n);
+    for (int j = 0; j < n; ++j) {
+        permutation[j] = j;
+    }
+    Sparse result;
+    result.n = n;
+    result.row_start.push_back(0);
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < per_row; ++k) {
+            std::uniform_int_distribution<int> pick(k, n - 1);
+            std::swap(permutation[k], permutation[pick(mt)]);
+        }
+        const size_t start = result.columns.size();
+        result.columns.insert(result.columns.end(), permutation.begin(), permutation.begin() + per_row);
+        std::sort(result.columns.begin() + start, result.columns.end());
+        for (int k = 0; k < per_row; ++k) {
+            result.values.push_back(dis(mt) / per_row);
+        }
+        result.row_start.push_back(int(result.columns.size()));
+    }
+    return result;
+}
+
+double DenseMatrix::at(int i, int j) const {
+    return dense.at(i, j);
+}
+
+void DenseMatrix::multiply(const double* x, double* y) const {
+    dense.multiply(x, y);
+}
+
+double DiagonalMatrix::at(int i, int j) const {
+    return diagonal.at(i, j);
+}
+
+void DiagonalMatrix::multiply(const double* x, double* y) const {
+    diagonal.multiply(x, y);
+}
+
+double SparseMatrix::at(int i, int j) const {
+    return sparse.at(i, j);
+}
+
+void SparseMatrix::multiply(const double* x, double* y) const {
+    sparse.multiply(x, y);
+}
@@ -1,14 +1,161 @@
-class Matrix {
+#include <array>
+#include <random>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Built with -DMATRIX_FINAL=final to see what marking the class final buys
+#ifndef MATRIX_FINAL
+#define MATRIX_FINAL
+#endif
+
+class Matrix MATRIX_FINAL {
   public:
     int n, m;
     double* arr = nullptr;
     Matrix(int n_, int m_);
     Matrix(const Matrix& other);
+    Matrix(Matrix&& other) noexcept;
     virtual ~Matrix();
     double* operator[](int subscript) const;
     Matrix& operator=(const Matrix& other);
+    Matrix& operator=(Matrix&& other) noexcept;
     static Matrix getRandom(int n, int m);
 };
 
 Matrix operator*(const Matrix& a, const Matrix& b);
 
+// Picks where Matrix elements come from: malloc (the default), pool or huge,
+// see benchmark_multiple_files.cc. False if unknown.
+bool set_matrix_storage(const char* name);
+
+// Picks the kernel operator* and multiply_into use: naive (the default),
+// ikj, avx2, avx512 or auto, the best one this CPU has. False if unknown or
+// not supported by the CPU.
+bool set_multiply_kernel(const char* name);
+
+// out = a * b, reusing the buffer of out when it already has the right size.
+// out must not be a or b.
+void multiply_into(Matrix& out, const Matrix& a, const Matrix& b);
+
+// Same matrix with the sizes known at compile time: the elements live inline
+// and the multiply loops have constant bounds the compiler can unroll and
+// vectorize. The virtual destructor is kept so only the sizing differs.
+// Defined in benchmark_multiple_files.cc, which instantiates the 16x16 one.
+template <int N, int M>
+class FixedMatrix {
+  public:
+    std::array<double, N * M> arr;
+    virtual ~FixedMatrix();
+    double* operator[](int subscript);
+    const double* operator[](int subscript) const;
+    static FixedMatrix getRandom();
+};
+
+template <int N, int M, int P>
+FixedMatrix<N, P> operator*(const FixedMatrix<N, M>& a, const FixedMatrix<M, P>& b);
+
+extern template class FixedMatrix<16, 16>;
+extern template FixedMatrix<16, 16> operator*(const FixedMatrix<16, 16>& a, const FixedMatrix<16, 16>& b);
+
+// Square operators with three layouts, for comparing dispatch strategies.
+// The kernels are shared, only the way they get called differs: virtual
+// calls through MatrixBase pointers, std::visit over VariantMatrix, or CRTP
+// through StaticMatrix<Derived>. Everything but the CRTP templates is
+// defined in benchmark_multiple_files.cc, so the calls cross translation
+// units.
+struct Dense {
+    int n = 0;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Dense random(int n, std::mt19937_64& mt);
+};
+
+struct Diagonal {
+    int n = 0;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Diagonal random(int n, std::mt19937_64& mt);
+};
+
+// Compressed rows, a few entries per row
+struct Sparse {
+    int n = 0;
+    std::vector<int> row_start, columns;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Sparse random(int n, std::mt19937_64& mt);
+};
+
+class MatrixBase {
+  public:
+    virtual ~MatrixBase() {}
+    virtual double at(int i, int j) const = 0;
+    // y = this * x
+    virtual void multiply(const double* x, double* y) const = 0;
+};
+
+class DenseMatrix : public MatrixBase {
+  public:
+    Dense dense;
+    explicit DenseMatrix(Dense d) : dense(std::move(d)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+class DiagonalMatrix : public MatrixBase {
+  public:
+    Diagonal diagonal;
+    explicit DiagonalMatrix(Diagonal d) : diagonal(std::move(d)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+class SparseMatrix : public MatrixBase {
+  public:
+    Sparse sparse;
+    explicit SparseMatrix(Sparse s) : sparse(std::move(s)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+using VariantMatrix = std::variant<Dense, Diagonal, Sparse>;
+
+template <typename Derived>
+class StaticMatrix {
+  public:
+    double at(int i, int j) const {
+        return self().impl().at(i, j);
+    }
+    void multiply(const double* x, double* y) const {
+        self().impl().multiply(x, y);
+    }
+  private:
+    const Derived& self() const {
+        return static_cast<const Derived&>(*this);
+    }
+};
+
+class StaticDense : public StaticMatrix<StaticDense> {
+  public:
+    Dense dense;
+    explicit StaticDense(Dense d) : dense(std::move(d)) {}
+    const Dense& impl() const { return dense; }
+};
+
+class StaticDiagonal : public StaticMatrix<StaticDiagonal> {
+  public:
+    Diagonal diagonal;
+    explicit StaticDiagonal(Diagonal d) : diagonal(std::move(d)) {}
+    const Diagonal& impl() const { return diagonal; }
+};
+
+class StaticSparse : public StaticMatrix<StaticSparse> {
+  public:
+    Sparse sparse;
+    explicit StaticSparse(Sparse s) : sparse(std::move(s)) {}
+    const Sparse& impl() const { return sparse; }
+};
@@ -1,17 +1,384 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "benchmark_multiple_files.h"
 
-int main() {
+// Fixed set of workers, each with its own deque of tasks. Workers pop their
+// own tasks from the back and steal from the front of the others' deques
+// when they run out, so uneven tasks still keep every core busy.
+class WorkStealingPool {
+  public:
+    explicit WorkStealingPool(int num_threads) {
+        for (int t = 0; t < num_threads; ++t) {
+            queues.emplace_back(new Queue);
+        }
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back(&WorkStealingPool::work, this, t);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return int(threads.size());
+    }
+
+    // Runs fn(0) ... fn(count - 1) on the workers and waits for all of them
+    void parallel_for(long count, const std::function<void(long)>& fn_) {
+        if (count <= 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn = &fn_;
+            remaining = count;
+        }
+        // Contiguous ranges per worker, stealing evens them out
+        const long num_queues = long(queues.size());
+        for (long q = 0; q < num_queues; ++q) {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (long task = count * q / num_queues; task < count * (q + 1) / num_queues; ++task) {
+                queues[q]->tasks.push_back(task);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++generation;
+        }
+        wake.notify_all();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return remaining == 0; });
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<long> tasks;
+    };
+
+    bool pop(int self, long* task) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                *task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& victim = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                *task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int self) {
+        long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            long task;
+            while (pop(self, &task)) {
+                (*fn)(task);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0) {
+                    done.notify_all();
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(long)>* fn = nullptr;
+    long remaining = 0;
+    long generation = 0;
+    bool stopping = false;
+};
+
+// l multiplies and l element reads over 3 * K operators (dense, diagonal,
+// sparse, in that order, repeating) with each dispatch strategy. x stays the
+// same so every call does the same work, and the checksums show the three
+// agree. Timings on stderr.
+void run_dispatch(int n, long l) {
+    constexpr int K = 16;
+    std::mt19937_64 mt(42);
+    std::vector<Dense> dense;
+    std::vector<Diagonal> diagonal;
+    std::vector<Sparse> sparse;
+    for (int k = 0; k < K; ++k) {
+        dense.push_back(Dense::random(n, mt));
+        diagonal.push_back(Diagonal::random(n, mt));
+        sparse.push_back(Sparse::random(n, mt));
+    }
+    std::vector<std::unique_ptr<MatrixBase>> virtual_ops;
+    std::vector<VariantMatrix> variant_ops;
+    for (int k = 0; k < K; ++k) {
+        virtual_ops.emplace_back(new DenseMatrix(dense[k]));
+        virtual_ops.emplace_back(new DiagonalMatrix(diagonal[k]));
+        virtual_ops.emplace_back(new SparseMatrix(sparse[k]));
+        variant_ops.emplace_back(dense[k]);
+        variant_ops.emplace_back(diagonal[k]);
+        variant_ops.emplace_back(sparse[k]);
+    }
+    std::vector<StaticDense> static_dense;
+    std::vector<StaticDiagonal> static_diagonal;
+    std::vector<StaticSparse> static_sparse;
+    for (int k = 0; k < K; ++k) {
+        static_dense.emplace_back(dense[k]);
+        static_diagonal.emplace_back(diagonal[k]);
+        static_sparse.emplace_back(sparse[k]);
+    }
+    const long rounds = std::max(1L, l / 3);
+    std::vector<double> x(n, 1.0), y(n);
+
+    auto report = [&](const char* name, std::chrono::steady_clock::duration multiply,
+                      std::chrono::steady_clock::duration at, double checksum) {
+        fprintf(stderr, "%-8s multiply %.2lf ns, at %.2lf ns (checksum %.6g)\n", name,
+                std::chrono::duration<double, std::nano>(multiply).count() / (3 * rounds),
+                std::chrono::duration<double, std::nano>(at).count() / (3 * rounds),
+                checksum);
+    };
+
+    {
+        double checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                virtual_ops[r % K * 3 + t]->multiply(x.data(), y.data());
+                checksum += y[r % n];
+            }
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                checksum += virtual_ops[r % K * 3 + t]->at(r % n, r / n % n);
+            }
+        }
+        report("virtual", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+    {
+        double checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                std::visit([&](const auto& op) { op.multiply(x.data(), y.data()); },
+                           variant_ops[r % K * 3 + t]);
+                checksum += y[r % n];
+            }
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                checksum += std::visit([&](const auto& op) { return op.at(r % n, r / n % n); },
+                                       variant_ops[r % K * 3 + t]);
+            }
+        }
+        report("variant", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+    {
+        // The types are known statically, only the order of the calls is
+        // written out by hand
+        double checksum = 0;
+        auto multiply = [&](const auto& op, long r) {
+            op.multiply(x.data(), y.data());
+            checksum += y[r % n];
+        };
+        auto at = [&](const auto& op, long r) {
+            checksum += op.at(r % n, r / n % n);
+        };
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            multiply(static_dense[r % K], r);
+            multiply(static_diagonal[r % K], r);
+            multiply(static_sparse[r % K], r);
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            at(static_dense[r % K], r);
+            at(static_diagonal[r % K], r);
+            at(static_sparse[r % K], r);
+        }
+        report("crtp", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+}
+
+// Prints the throughput of a parallel mode on stderr. Threads beyond the
+// number of cores don't count as more cores.
+void print_throughput(const char* mode, long multiplies, int threads,
+                      std::chrono::steady_clock::duration elapsed) {
+    const double secs = std::chrono::duration<double>(elapsed).count();
+    const int cores = std::min(threads, std::max(1, int(std::thread::hardware_concurrency())));
+    fprintf(stderr, "%s: %ld multiplies on %d threads in %.3lf secs, %.0lf multiplies/sec, "
+            "%.0lf per core\n", mode, multiplies, threads, secs, multiplies / secs,
+            multiplies / secs / cores);
+}
+
+// copy: the original loop, a temporary plus a copy assignment per multiply
+// move: the temporary gets moved into res instead
+// into: multiply_into between two buffers, no allocation at all
+// fixed: FixedMatrix<N, N>, no allocation and compile-time sizes
+// alloc: copy again with the malloc, pool and huge page arena storages
+// chains: the multiplies split in independent chains on a work-stealing pool
+// tree: one chain multiplied as a tree of products on the pool
+// dispatch: dense/diagonal/sparse operators through virtual calls,
+// std::variant and CRTP
+// The kernel (naive by default, auto picks the best one the CPU has) is what
+// copy, move and into multiply with, and size overrides N for those.
+// multiplies overrides the number of multiplies, 10M at size 16, 0 keeps
+// that. threads (all the cores by default) and chains (4096) are for chains
+// and tree. storage (malloc, pool or huge) is where every mode but alloc gets
+// its elements from, so chains and tree show when allocation rather than
+// dispatch limits the scaling.
+int main(int argc, char** argv) {
     constexpr int N = 16;
     constexpr int L = 1000 * 1000 * 10;
-    auto a = Matrix::getRandom(N, N);
+    const char* mode = argc > 1 ? argv[1] : "copy";
+    const char* kernel = argc > 2 ? argv[2] : "naive";
+    // Bigger matrices do fewer multiplies, so every size does the same flops
+    const int n = argc > 3 ? atoi(argv[3]) : N;
+    const long l = argc > 4 && atol(argv[4]) > 0 ? atol(argv[4])
+                 : std::max(1L, long(double(L) * N * N * N / (double(n) * n * n)));
+    const int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    const int threads = argc > 5 ? atoi(argv[5]) : hardware;
+    const long chains = argc > 6 ? atol(argv[6]) : 4096;
+    const char* storage = argc > 7 ? argv[7] : "malloc";
+    if (!set_multiply_kernel(kernel) || !set_matrix_storage(storage)
+     || n <= 0 || threads <= 0 || chains <= 0
+     || (n != N && !strcmp(mode, "fixed"))) {
+        fprintf(stderr, "Usage: %s [copy|move|into|alloc|chains|tree|dispatch|fixed] "
+                "[naive|ikj|avx2|avx512|auto] [size] [multiplies] [threads] [chains] [malloc|pool|huge]\nfixed only does size %d\n", argv[0], N);
+        return 1;
+    }
+    auto a = Matrix::getRandom(n, n);
     Matrix res = a;
-    for (int i = 0; i < L; ++i) {
-        res = res * a;
+    if (!strcmp(mode, "copy")) {
+        for (long i = 0; i < l; ++i) {
+            res = static_cast<const Matrix&>(res * a);
+        }
+    } else if (!strcmp(mode, "move")) {
+        for (long i = 0; i < l; ++i) {
+            res = res * a;
+        }
+    } else if (!strcmp(mode, "into")) {
+        Matrix tmp(n, n);
+        for (long i = 0; i < l; ++i) {
+            multiply_into(tmp, res, a);
+            std::swap(res, tmp);
+        }
+    } else if (!strcmp(mode, "alloc")) {
+        // The copy loop once per storage, timings on stderr
+        for (const char* alloc_storage : {"malloc", "pool", "huge"}) {
+            set_matrix_storage(alloc_storage);
+            res = a;
+            const auto start = std::chrono::steady_clock::now();
+            for (long i = 0; i < l; ++i) {
+                res = static_cast<const Matrix&>(res * a);
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            fprintf(stderr, "%-6s %.3lf secs\n", alloc_storage, elapsed.count());
+        }
+    } else if (!strcmp(mode, "chains")) {
+        // K independent chains spread over the pool
+        WorkStealingPool pool(threads);
+        const long length = std::max(1L, l / chains);
+        std::vector<Matrix> results(chains, a);
+        const auto start = std::chrono::steady_clock::now();
+        pool.parallel_for(chains, [&](long k) {
+            Matrix chain = a;
+            for (long i = 0; i < length; ++i) {
+                chain = chain * a;
+            }
+            results[k] = std::move(chain);
+        });
+        print_throughput("chains", chains * length, threads, std::chrono::steady_clock::now() - start);
+        res = std::move(results[0]);
+    } else if (!strcmp(mode, "tree")) {
+        // The product of one chain of l matrices, multiplication being
+        // associative: serial products of segments, then pairwise products of
+        // those, a level of the tree at a time.
+        WorkStealingPool pool(threads);
+        const long segments = std::max(1L, std::min(l, long(threads) * 8));
+        std::vector<Matrix> parts(segments, a);
+        const auto start = std::chrono::steady_clock::now();
+        pool.parallel_for(segments, [&](long s) {
+            const long length = l * (s + 1) / segments - l * s / segments;
+            for (long i = 1; i < length; ++i) {
+                parts[s] = parts[s] * a;
+            }
+        });
+        while (parts.size() > 1) {
+            // Products go in place, then the level is packed by moves so
+            // that nothing but multiplies is timed
+            pool.parallel_for(long(parts.size() / 2), [&](long i) {
+                parts[2 * i] = parts[2 * i] * parts[2 * i + 1];
+            });
+            std::vector<Matrix> next;
+            next.reserve((parts.size() + 1) / 2);
+            for (size_t i = 0; i < parts.size(); i += 2) {
+                next.push_back(std::move(parts[i]));
+            }
+            parts = std::move(next);
+        }
+        print_throughput("tree", l - 1, threads, std::chrono::steady_clock::now() - start);
+        res = std::move(parts[0]);
+    } else if (!strcmp(mode, "dispatch")) {
+        run_dispatch(n, l);
+        // Nothing lands in res, there's no corner to print
+        return 0;
+    } else if (!strcmp(mode, "fixed")) {
+        auto fixedA = FixedMatrix<N, N>::getRandom();
+        FixedMatrix<N, N> fixedRes = fixedA;
+        for (long i = 0; i < l; ++i) {
+            fixedRes = fixedRes * fixedA;
+        }
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < N; ++j) {
+                res[i][j] = fixedRes[i][j];
+            }
+        }
+    } else {
+        fprintf(stderr, "Usage: %s [copy|move|into|alloc|chains|tree|dispatch|fixed] "
+                "[naive|ikj|avx2|avx512|auto] [size] [multiplies] [threads] [chains] [malloc|pool|huge]\n", argv[0]);
+        return 1;
     }
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
+    // The top left 16x16 corner is plenty to check the kernels agree
+    for (int i = 0; i < std::min(n, N); ++i) {
+        for (int j = 0; j < std::min(n, N); ++j) {
             printf("%.4lf ", res[i][j]);
         }
         printf("\n");
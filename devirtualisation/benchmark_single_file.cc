@@ -1,8 +1,203 @@
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <random>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
 
-class Matrix {
+#include <immintrin.h>
+
+#include "../huge_page_arena.h"
+
+// Where Matrix gets its elements from, to see how much of the benchmark is
+// really allocator and TLB cost:
+//   malloc: new[] and delete[] every time (the default)
+//   pool: per thread free lists keyed by size on top of new[]
+//   huge: the same free lists carving from a per thread arena of huge pages
+enum class Storage { Malloc, Pool, Huge };
+static Storage matrix_storage = Storage::Malloc;
+
+// Freed buffers by number of elements. There are only a couple of sizes in
+// flight, a linear search beats hashing.
+struct SizePool {
+    std::vector<std::pair<size_t, std::vector<double*>>> lists;
+
+    std::vector<double*>& list(size_t size) {
+        for (auto& entry : lists) {
+            if (entry.first == size) {
+                return entry.second;
+            }
+        }
+        lists.emplace_back(size, std::vector<double*>());
+        return lists.back().second;
+    }
+
+    double* take(size_t size) {
+        std::vector<double*>& free = list(size);
+        if (free.empty()) {
+            return nullptr;
+        }
+        double* arr = free.back();
+        free.pop_back();
+        return arr;
+    }
+};
+
+struct MallocPool : SizePool {
+    ~MallocPool() {
+        for (auto& entry : lists) {
+            for (double* arr : entry.second) {
+                delete[] arr;
+            }
+        }
+    }
+};
+
+// 1GiB of address space from huge_page_arena.h, 2MiB aligned and madvised
+// so THP backs it. Only the part we carve out gets faulted in.
+struct HugeArena : SizePool {
+    static constexpr size_t SIZE = 1UL << 30;
+    hugepages::HugePageArena arena{SIZE, options()};
+
+    static hugepages::Options options() {
+        hugepages::Options options = hugepages::HugePageArena::defaultOptions();
+        options.kind = hugepages::PAGE_THP;
+        return options;
+    }
+
+    double* carve(size_t size) {
+        return (double*) arena.allocate(size * sizeof(double), 64);
+    }
+};
+
+// Matrices move between threads (chains built on pool workers are destroyed
+// in main), so a buffer can be released on a thread that didn't carve it, or
+// after that thread is gone. Arenas are never unmapped: every one is in
+// huge_arenas, which only grows and is read without locking, and the arena of
+// a thread that exits goes to the next thread that needs one, free lists
+// included.
+constexpr int MAX_HUGE_ARENAS = 1024;
+static std::atomic<HugeArena*> huge_arenas[MAX_HUGE_ARENAS];
+static std::atomic<int> num_huge_arenas{0};
+static std::mutex idle_huge_arenas_lock;
+static std::vector<HugeArena*> idle_huge_arenas;
+
+static bool is_huge_arena_memory(const double* arr) {
+    const int count = std::min(num_huge_arenas.load(std::memory_order_acquire), MAX_HUGE_ARENAS);
+    for (int i = 0; i < count; ++i) {
+        const HugeArena* arena = huge_arenas[i].load(std::memory_order_acquire);
+        if (arena && arena->arena.owns(arr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The arena of the calling thread, null if there are too many already
+struct HugeArenaHandle {
+    HugeArena* arena = nullptr;
+
+    HugeArena* get() {
+        if (arena) {
+            return arena;
+        }
+        {
+            std::lock_guard<std::mutex> guard(idle_huge_arenas_lock);
+            if (!idle_huge_arenas.empty()) {
+                arena = idle_huge_arenas.back();
+                idle_huge_arenas.pop_back();
+                return arena;
+            }
+        }
+        const int slot = num_huge_arenas.fetch_add(1);
+        if (slot >= MAX_HUGE_ARENAS) {
+            return nullptr;
+        }
+        arena = new HugeArena;
+        huge_arenas[slot].store(arena, std::memory_order_release);
+        return arena;
+    }
+
+    ~HugeArenaHandle() {
+        if (arena) {
+            std::lock_guard<std::mutex> guard(idle_huge_arenas_lock);
+            idle_huge_arenas.push_back(arena);
+        }
+    }
+};
+
+static thread_local MallocPool malloc_pool;
+static thread_local HugeArenaHandle huge_arena;
+
+double* allocate_elements(size_t size) {
+    double* arr = nullptr;
+    if (matrix_storage == Storage::Pool) {
+        arr = malloc_pool.take(size);
+    } else if (matrix_storage == Storage::Huge) {
+        if (HugeArena* arena = huge_arena.get()) {
+            arr = arena->take(size);
+            if (!arr) {
+                arr = arena->carve(size);
+            }
+        }
+    }
+    // The arena can run out, new[] is always there
+    return arr ? arr : new double[size];
+}
+
+// Arena buffers go to the free lists of the calling thread's arena, whichever
+// arena they come from, the others were new[]ed: they go to the pool or get
+// deleted, whatever the storage is now
+void release_elements(double* arr, size_t size) {
+    if (arr == nullptr) {
+        return;
+    }
+    // No arena was ever made with malloc or pool storage, skip the scan
+    if (num_huge_arenas.load(std::memory_order_relaxed) != 0 && is_huge_arena_memory(arr)) {
+        // Leaked rather than delete[]d if this thread can't get an arena
+        HugeArena* arena = huge_arena.get();
+        if (arena) {
+            arena->list(size).push_back(arr);
+        }
+    } else if (matrix_storage == Storage::Pool) {
+        malloc_pool.list(size).push_back(arr);
+    } else {
+        delete[] arr;
+    }
+}
+
+bool set_matrix_storage(const char* name) {
+    if (!strcmp(name, "malloc")) {
+        matrix_storage = Storage::Malloc;
+    } else if (!strcmp(name, "pool")) {
+        matrix_storage = Storage::Pool;
+    } else if (!strcmp(name, "huge")) {
+        matrix_storage = Storage::Huge;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Built with -DMATRIX_FINAL=final to see what marking the class final buys
+#ifndef MATRIX_FINAL
+#define MATRIX_FINAL
+#endif
+
+class Matrix MATRIX_FINAL {
   public:
     int n, m;
     double* arr = nullptr;
@@ -10,7 +205,7 @@ class Matrix {
     : n(n_)
     , m(m_)
     {
-        arr = new double[n * m];
+        arr = allocate_elements(size_t(n) * m);
     }
 
 	Matrix(const Matrix& other)
@@ -22,8 +217,16 @@ class Matrix {
 		}
 	}
 
+    Matrix(Matrix&& other) noexcept
+    : n(other.n)
+    , m(other.m)
+    , arr(other.arr)
+    {
+        other.arr = nullptr;
+    }
+
     virtual ~Matrix() {
-        delete[] arr;
+        release_elements(arr, size_t(n) * m);
         arr = nullptr;
     }
 
@@ -32,12 +235,10 @@ class Matrix {
     }
 
     Matrix& operator=(const Matrix& other) {
+        release_elements(arr, size_t(n) * m);
         n = other.n;
         m = other.m;
-        if (arr != nullptr) {
-            delete[] arr;
-        }
-        arr = new double[n * m];
+        arr = allocate_elements(size_t(n) * m);
 		for (int i = 0; i < n; ++i) {
 			for (int j = 0; j < m; ++j) {
 				arr[i * m + j] = other[i][j];
@@ -46,6 +247,13 @@ class Matrix {
         return *this;
     }
 
+    Matrix& operator=(Matrix&& other) noexcept {
+        std::swap(n, other.n);
+        std::swap(m, other.m);
+        std::swap(arr, other.arr);
+        return *this;
+    }
+
     static Matrix getRandom(int n, int m) {
         std::random_device rd;
         std::mt19937_64 mt(rd());
@@ -65,11 +273,147 @@ class Matrix {
     }
 };
 
+// The multiply kernels, out = a * b with a n x m and b m x p. out doesn't
+// alias a or b, which the compiler gets told through __restrict.
+
+// i-k-j order: the inner loop updates a whole row of out with a row of b,
+// which vectorizes without reassociating the sums.
+void multiply_ikj(double* __restrict out, const double* __restrict a,
+                  const double* __restrict b, int n, int m, int p) {
+    for (int i = 0; i < n; ++i) {
+        double* __restrict row = out + i * p;
+        for (int j = 0; j < p; ++j) {
+            row[j] = 0;
+        }
+        for (int k = 0; k < m; ++k) {
+            const double aik = a[i * m + k];
+            const double* __restrict bk = b + k * p;
+            for (int j = 0; j < p; ++j) {
+                row[j] += aik * bk[j];
+            }
+        }
+    }
+}
+
+// Blocks of b the register-blocked kernels work on, KC x NC doubles (256kB)
+// so they stay in L2 while every row block of a goes over them.
+constexpr int KC = 128;
+constexpr int NC = 256;
+
+// 4 rows x 8 columns of out kept in 8 ymm registers while going down k.
+__attribute__((target("avx2,fma")))
+void multiply_avx2(double* __restrict out, const double* __restrict a,
+                   const double* __restrict b, int n, int m, int p) {
+    if (n % 4 || p % 8) {
+        multiply_ikj(out, a, b, n, m, p);
+        return;
+    }
+    std::fill(out, out + n * p, 0.0);
+    for (int kk = 0; kk < m; kk += KC) {
+        const int kend = std::min(kk + KC, m);
+        for (int jj = 0; jj < p; jj += NC) {
+            const int jend = std::min(jj + NC, p);
+            for (int i = 0; i < n; i += 4) {
+                for (int j = jj; j < jend; j += 8) {
+                    __m256d acc[4][2];
+                    for (int r = 0; r < 4; ++r) {
+                        acc[r][0] = _mm256_loadu_pd(out + (i + r) * p + j);
+                        acc[r][1] = _mm256_loadu_pd(out + (i + r) * p + j + 4);
+                    }
+                    for (int k = kk; k < kend; ++k) {
+                        const __m256d b0 = _mm256_loadu_pd(b + k * p + j);
+                        const __m256d b1 = _mm256_loadu_pd(b + k * p + j + 4);
+                        for (int r = 0; r < 4; ++r) {
+                            const __m256d air = _mm256_broadcast_sd(a + (i + r) * m + k);
+                            acc[r][0] = _mm256_fmadd_pd(air, b0, acc[r][0]);
+                            acc[r][1] = _mm256_fmadd_pd(air, b1, acc[r][1]);
+                        }
+                    }
+                    for (int r = 0; r < 4; ++r) {
+                        _mm256_storeu_pd(out + (i + r) * p + j, acc[r][0]);
+                        _mm256_storeu_pd(out + (i + r) * p + j + 4, acc[r][1]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Same with 4 rows x 16 columns in 8 zmm registers.
+__attribute__((target("avx512f")))
+void multiply_avx512(double* __restrict out, const double* __restrict a,
+                     const double* __restrict b, int n, int m, int p) {
+    if (n % 4 || p % 16) {
+        multiply_ikj(out, a, b, n, m, p);
+        return;
+    }
+    std::fill(out, out + n * p, 0.0);
+    for (int kk = 0; kk < m; kk += KC) {
+        const int kend = std::min(kk + KC, m);
+        for (int jj = 0; jj < p; jj += NC) {
+            const int jend = std::min(jj + NC, p);
+            for (int i = 0; i < n; i += 4) {
+                for (int j = jj; j < jend; j += 16) {
+                    __m512d acc[4][2];
+                    for (int r = 0; r < 4; ++r) {
+                        acc[r][0] = _mm512_loadu_pd(out + (i + r) * p + j);
+                        acc[r][1] = _mm512_loadu_pd(out + (i + r) * p + j + 8);
+                    }
+                    for (int k = kk; k < kend; ++k) {
+                        const __m512d b0 = _mm512_loadu_pd(b + k * p + j);
+                        const __m512d b1 = _mm512_loadu_pd(b + k * p + j + 8);
+                        for (int r = 0; r < 4; ++r) {
+                            const __m512d air = _mm512_set1_pd(a[(i + r) * m + k]);
+                            acc[r][0] = _mm512_fmadd_pd(air, b0, acc[r][0]);
+                            acc[r][1] = _mm512_fmadd_pd(air, b1, acc[r][1]);
+                        }
+                    }
+                    for (int r = 0; r < 4; ++r) {
+                        _mm512_storeu_pd(out + (i + r) * p + j, acc[r][0]);
+                        _mm512_storeu_pd(out + (i + r) * p + j + 8, acc[r][1]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+using MultiplyKernel = void (*)(double* __restrict, const double* __restrict,
+                                const double* __restrict, int, int, int);
+
+// What operator* and multiply_into use. Null (naive, the default) keeps the
+// original loop inline in them, so the baseline doesn't pay an indirect call
+// per multiply.
+static MultiplyKernel multiply_kernel = nullptr;
+
+bool set_multiply_kernel(const char* name) {
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool avx512 = __builtin_cpu_supports("avx512f");
+    if (!strcmp(name, "auto")) {
+        multiply_kernel = avx512 ? multiply_avx512 : avx2 ? multiply_avx2 : multiply_ikj;
+    } else if (!strcmp(name, "naive")) {
+        multiply_kernel = nullptr;
+    } else if (!strcmp(name, "ikj")) {
+        multiply_kernel = multiply_ikj;
+    } else if (!strcmp(name, "avx2") && avx2) {
+        multiply_kernel = multiply_avx2;
+    } else if (!strcmp(name, "avx512") && avx512) {
+        multiply_kernel = multiply_avx512;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 Matrix operator*(const Matrix& a, const Matrix& b) {
     if (a.m != b.n) {
         throw std::invalid_argument("Attempting to multiply matrices but the sizes don't match!");
     }
     Matrix result(a.n, b.m);
+    if (multiply_kernel) {
+        multiply_kernel(result.arr, a.arr, b.arr, a.n, a.m, b.m);
+        return result;
+    }
     for (int i = 0; i < a.n; ++i) {
         for (int j = 0; j < b.m; ++j) {
             result[i][j] = 0;
@@ -81,16 +425,671 @@ Matrix operator*(const Matrix& a, const Matrix& b) {
     return result;
 }
 
-int main() {
+// Same matrix with the sizes known at compile time: the elements live inline
+// and the multiply loops have constant bounds the compiler can unroll and
+// vectorize. The virtual destructor is kept so only the sizing differs.
+template <int N, int M>
+class FixedMatrix {
+  public:
+    std::array<double, N * M> arr;
+
+    virtual ~FixedMatrix() {}
+
+    double* operator[](int subscript) {
+        return arr.data() + subscript * M;
+    }
+
+    const double* operator[](int subscript) const {
+        return arr.data() + subscript * M;
+    }
+
+    static FixedMatrix getRandom() {
+        std::random_device rd;
+        std::mt19937_64 mt(rd());
+        std::uniform_real_distribution<> dis(0, 1);
+        FixedMatrix result;
+        for (int i = 0; i < N; ++i) {
+            double sum = 0;
+            for (int j = 0; j < M; ++j) {
+                result[i][j] = dis(mt);
+                sum += result[i][j];
+            }
+            for (int j = 0; j < M; ++j) {
+                result[i][j] /= sum;
+            }
+        }
+        return result;
+    }
+};
+
+// i-k-j order: the inner loop updates a whole row of the result, which
+// vectorizes without reassociating the sums.
+template <int N, int M, int P>
+FixedMatrix<N, P> operator*(const FixedMatrix<N, M>& a, const FixedMatrix<M, P>& b) {
+    FixedMatrix<N, P> result;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < P; ++j) {
+            result[i][j] = 0;
+        }
+        for (int k = 0; k < M; ++k) {
+            const double aik = a[i][k];
+            for (int j = 0; j < P; ++j) {
+                result[i][j] += aik * b[k][j];
+            }
+        }
+    }
+    return result;
+}
+
+// out = a * b, reusing the buffer of out when it already has the right size.
+// out must not be a or b.
+void multiply_into(Matrix& out, const Matrix& a, const Matrix& b) {
+    if (a.m != b.n) {
+        throw std::invalid_argument("Attempting to multiply matrices but the sizes don't match!");
+    }
+    if (out.n * out.m != a.n * b.m) {
+        out = Matrix(a.n, b.m);
+    }
+    out.n = a.n;
+    out.m = b.m;
+    if (multiply_kernel) {
+        multiply_kernel(out.arr, a.arr, b.arr, a.n, a.m, b.m);
+        return;
+    }
+    for (int i = 0; i < a.n; ++i) {
+        for (int j = 0; j < b.m; ++j) {
+            out[i][j] = 0;
+            for (int k = 0; k < a.m; ++k) {
+                out[i][j] += a[i][k] * b[k][j];
+            }
+        }
+    }
+}
+
+// Fixed set of workers, each with its own deque of tasks. Workers pop their
+// own tasks from the back and steal from the front of the others' deques
+// when they run out, so uneven tasks still keep every core busy.
+class WorkStealingPool {
+  public:
+    explicit WorkStealingPool(int num_threads) {
+        for (int t = 0; t < num_threads; ++t) {
+            queues.emplace_back(new Queue);
+        }
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back(&WorkStealingPool::work, this, t);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return int(threads.size());
+    }
+
+    // Runs fn(0) ... fn(count - 1) on the workers and waits for all of them
+    void parallel_for(long count, const std::function<void(long)>& fn_) {
+        if (count <= 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn = &fn_;
+            remaining = count;
+        }
+        // Contiguous ranges per worker, stealing evens them out
+        const long num_queues = long(queues.size());
+        for (long q = 0; q < num_queues; ++q) {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (long task = count * q / num_queues; task < count * (q + 1) / num_queues; ++task) {
+                queues[q]->tasks.push_back(task);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++generation;
+        }
+        wake.notify_all();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return remaining == 0; });
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<long> tasks;
+    };
+
+    bool pop(int self, long* task) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                *task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& victim = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                *task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int self) {
+        long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            long task;
+            while (pop(self, &task)) {
+                (*fn)(task);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0) {
+                    done.notify_all();
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(long)>* fn = nullptr;
+    long remaining = 0;
+    long generation = 0;
+    bool stopping = false;
+};
+
+// Square operators with three layouts, for comparing dispatch strategies.
+// The kernels are shared, only the way they get called differs: virtual
+// calls through MatrixBase pointers, std::visit over VariantMatrix, or CRTP
+// through StaticMatrix<Derived>.
+struct Dense {
+    int n = 0;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Dense random(int n, std::mt19937_64& mt);
+};
+
+struct Diagonal {
+    int n = 0;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Diagonal random(int n, std::mt19937_64& mt);
+};
+
+// Compressed rows, a few entries per row
+struct Sparse {
+    int n = 0;
+    std::vector<int> row_start, columns;
+    std::vector<double> values;
+    double at(int i, int j) const;
+    void multiply(const double* x, double* y) const;
+    static Sparse random(int n, std::mt19937_64& mt);
+};
+
+class MatrixBase {
+  public:
+    virtual ~MatrixBase() {}
+    virtual double at(int i, int j) const = 0;
+    // y = this * x
+    virtual void multiply(const double* x, double* y) const = 0;
+};
+
+class DenseMatrix : public MatrixBase {
+  public:
+    Dense dense;
+    explicit DenseMatrix(Dense d) : dense(std::move(d)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+class DiagonalMatrix : public MatrixBase {
+  public:
+    Diagonal diagonal;
+    explicit DiagonalMatrix(Diagonal d) : diagonal(std::move(d)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+class SparseMatrix : public MatrixBase {
+  public:
+    Sparse sparse;
+    explicit SparseMatrix(Sparse s) : sparse(std::move(s)) {}
+    double at(int i, int j) const override;
+    void multiply(const double* x, double* y) const override;
+};
+
+using VariantMatrix = std::variant<Dense, Diagonal, Sparse>;
+
+template <typename Derived>
+class StaticMatrix {
+  public:
+    double at(int i, int j) const {
+        return self().impl().at(i, j);
+    }
+    void multiply(const double* x, double* y) const {
+        self().impl().multiply(x, y);
+    }
+  private:
+    const Derived& self() const {
+        return static_cast<const Derived&>(*this);
+    }
+};
+
+class StaticDense : public StaticMatrix<StaticDense> {
+  public:
+    Dense dense;
+    explicit StaticDense(Dense d) : dense(std::move(d)) {}
+    const Dense& impl() const { return dense; }
+};
+
+class StaticDiagonal : public StaticMatrix<StaticDiagonal> {
+  public:
+    Diagonal diagonal;
+    explicit StaticDiagonal(Diagonal d) : diagonal(std::move(d)) {}
+    const Diagonal& impl() const { return diagonal; }
+};
+
+class StaticSparse : public StaticMatrix<StaticSparse> {
+  public:
+    Sparse sparse;
+    explicit StaticSparse(Sparse s) : sparse(std::move(s)) {}
+    const Sparse& impl() const { return sparse; }
+};
+
+double Dense::at(int i, int j) const {
+    return values[i * n + j];
+}
+
+void Dense::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        double sum = 0;
+        for (int j = 0; j < n; ++j) {
+            sum += values[i * n + j] * x[j];
+        }
+        y[i] = sum;
+    }
+}
+
+Dense Dense::random(int n, std::mt19937_64& mt) {
+    std::uniform_real_distribution<> dis(0, 1);
+    Dense result;
+    result.n = n;
+    result.values.resize(n * n);
+    for (double& value : result.values) {
+        value = dis(mt) / n;
+    }
+    return result;
+}
+
+double Diagonal::at(int i, int j) const {
+    return i == j ? values[i] : 0;
+}
+
+void Diagonal::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        y[i] = values[i] * x[i];
+    }
+}
+
+Diagonal Diagonal::random(int n, std::mt19937_64& mt) {
+    std::uniform_real_distribution<> dis(0, 1);
+    Diagonal result;
+    result.n = n;
+    result.values.resize(n);
+    for (double& value : result.values) {
+        value = dis(mt);
+    }
+    return result;
+}
+
+double Sparse::at(int i, int j) const {
+    for (int k = row_start[i]; k < row_start[i + 1]; ++k) {
+        if (columns[k] == j) {
+            return values[k];
+        }
+    }
+    return 0;
+}
+
+void Sparse::multiply(const double* x, double* y) const {
+    for (int i = 0; i < n; ++i) {
+        double sum = 0;
+        for (int k = row_start[i]; k < row_start[i + 1]; ++k) {
+            sum += values[k] * x[columns[k]];
+        }
+        y[i] = sum;
+    }
+}
+
+Sparse Sparse::random(int n, std::mt19937_64& mt) {
+    constexpr int PER_ROW = 3;
+    const int per_row = std::min(n, PER_ROW);
+    std::uniform_real_distribution<> dis(0, 1);
+    // Distinct columns in each row, sorted like CSR: the first per_row
+    // entries of a partial shuffle of 0..n-1, which stays a permutation from
+    // one row to the next
+    std::vector<int> permutation(n);
+    for (int j = 0; j < n; ++j) {
+        permutation[j] = j;
+    }
+    Sparse result;
+    result.n = n;
+    result.row_start.push_back(0);
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < per_row; ++k) {
+            std::uniform_int_distribution<int> pick(k, n - 1);
+            std::swap(permutation[k], permutation[pick(mt)]);
+        }
+        const size_t start = result.columns.size();
+        result.columns.insert(result.columns.end(), permutation.begin(), permutation.begin() + per_row);
+        std::sort(result.columns.begin() + start, result.columns.end());
+        for (int k = 0; k < per_row; ++k) {
+            result.values.push_back(dis(mt) / per_row);
+        }
+        result.row_start.push_back(int(result.columns.size()));
+    }
+    return result;
+}
+
+double DenseMatrix::at(int i, int j) const {
+    return dense.at(i, j);
+}
+
+void DenseMatrix::multiply(const double* x, double* y) const {
+    dense.multiply(x, y);
+}
+
+double DiagonalMatrix::at(int i, int j) const {
+    return diagonal.at(i, j);
+}
+
+void DiagonalMatrix::multiply(const double* x, double* y) const {
+    diagonal.multiply(x, y);
+}
+
+double SparseMatrix::at(int i, int j) const {
+    return sparse.at(i, j);
+}
+
+void SparseMatrix::multiply(const double* x, double* y) const {
+    sparse.multiply(x, y);
+}
+
+// l multiplies and l element reads over 3 * K operators (dense, diagonal,
+// sparse, in that order, repeating) with each dispatch strategy. x stays the
+// same so every call does the same work, and the checksums show the three
+// agree. Timings on stderr.
+void run_dispatch(int n, long l) {
+    constexpr int K = 16;
+    std::mt19937_64 mt(42);
+    std::vector<Dense> dense;
+    std::vector<Diagonal> diagonal;
+    std::vector<Sparse> sparse;
+    for (int k = 0; k < K; ++k) {
+        dense.push_back(Dense::random(n, mt));
+        diagonal.push_back(Diagonal::random(n, mt));
+        sparse.push_back(Sparse::random(n, mt));
+    }
+    std::vector<std::unique_ptr<MatrixBase>> virtual_ops;
+    std::vector<VariantMatrix> variant_ops;
+    for (int k = 0; k < K; ++k) {
+        virtual_ops.emplace_back(new DenseMatrix(dense[k]));
+        virtual_ops.emplace_back(new DiagonalMatrix(diagonal[k]));
+        virtual_ops.emplace_back(new SparseMatrix(sparse[k]));
+        variant_ops.emplace_back(dense[k]);
+        variant_ops.emplace_back(diagonal[k]);
+        variant_ops.emplace_back(sparse[k]);
+    }
+    std::vector<StaticDense> static_dense;
+    std::vector<StaticDiagonal> static_diagonal;
+    std::vector<StaticSparse> static_sparse;
+    for (int k = 0; k < K; ++k) {
+        static_dense.emplace_back(dense[k]);
+        static_diagonal.emplace_back(diagonal[k]);
+        static_sparse.emplace_back(sparse[k]);
+    }
+    const long rounds = std::max(1L, l / 3);
+    std::vector<double> x(n, 1.0), y(n);
+
+    auto report = [&](const char* name, std::chrono::steady_clock::duration multiply,
+                      std::chrono::steady_clock::duration at, double checksum) {
+        fprintf(stderr, "%-8s multiply %.2lf ns, at %.2lf ns (checksum %.6g)\n", name,
+                std::chrono::duration<double, std::nano>(multiply).count() / (3 * rounds),
+                std::chrono::duration<double, std::nano>(at).count() / (3 * rounds),
+                checksum);
+    };
+
+    {
+        double checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                virtual_ops[r % K * 3 + t]->multiply(x.data(), y.data());
+                checksum += y[r % n];
+            }
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                checksum += virtual_ops[r % K * 3 + t]->at(r % n, r / n % n);
+            }
+        }
+        report("virtual", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+    {
+        double checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                std::visit([&](const auto& op) { op.multiply(x.data(), y.data()); },
+                           variant_ops[r % K * 3 + t]);
+                checksum += y[r % n];
+            }
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            for (int t = 0; t < 3; ++t) {
+                checksum += std::visit([&](const auto& op) { return op.at(r % n, r / n % n); },
+                                       variant_ops[r % K * 3 + t]);
+            }
+        }
+        report("variant", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+    {
+        // The types are known statically, only the order of the calls is
+        // written out by hand
+        double checksum = 0;
+        auto multiply = [&](const auto& op, long r) {
+            op.multiply(x.data(), y.data());
+            checksum += y[r % n];
+        };
+        auto at = [&](const auto& op, long r) {
+            checksum += op.at(r % n, r / n % n);
+        };
+        const auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            multiply(static_dense[r % K], r);
+            multiply(static_diagonal[r % K], r);
+            multiply(static_sparse[r % K], r);
+        }
+        const auto middle = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r) {
+            at(static_dense[r % K], r);
+            at(static_diagonal[r % K], r);
+            at(static_sparse[r % K], r);
+        }
+        report("crtp", middle - start, std::chrono::steady_clock::now() - middle, checksum);
+    }
+}
+
+// Prints the throughput of a parallel mode on stderr. Threads beyond the
+// number of cores don't count as more cores.
+void print_throughput(const char* mode, long multiplies, int threads,
+                      std::chrono::steady_clock::duration elapsed) {
+    const double secs = std::chrono::duration<double>(elapsed).count();
+    const int cores = std::min(threads, std::max(1, int(std::thread::hardware_concurrency())));
+    fprintf(stderr, "%s: %ld multiplies on %d threads in %.3lf secs, %.0lf multiplies/sec, "
+            "%.0lf per core\n", mode, multiplies, threads, secs, multiplies / secs,
+            multiplies / secs / cores);
+}
+
+// copy: the original loop, a temporary plus a copy assignment per multiply
+// move: the temporary gets moved into res instead
+// into: multiply_into between two buffers, no allocation at all
+// fixed: FixedMatrix<N, N>, no allocation and compile-time sizes
+// alloc: copy again with the malloc, pool and huge page arena storages
+// chains: the multiplies split in independent chains on a work-stealing pool
+// tree: one chain multiplied as a tree of products on the pool
+// dispatch: dense/diagonal/sparse operators through virtual calls,
+// std::variant and CRTP
+// The kernel (naive by default, auto picks the best one the CPU has) is what
+// copy, move and into multiply with, and size overrides N for those.
+// multiplies overrides the number of multiplies, 10M at size 16, 0 keeps
+// that. threads (all the cores by default) and chains (4096) are for chains
+// and tree. storage (malloc, pool or huge) is where every mode but alloc gets
+// its elements from, so chains and tree show when allocation rather than
+// dispatch limits the scaling.
+int main(int argc, char** argv) {
     constexpr int N = 16;
     constexpr int L = 1000 * 1000 * 10;
-    auto a = Matrix::getRandom(N, N);
+    const char* mode = argc > 1 ? argv[1] : "copy";
+    const char* kernel = argc > 2 ? argv[2] : "naive";
+    // Bigger matrices do fewer multiplies, so every size does the same flops
+    const int n = argc > 3 ? atoi(argv[3]) : N;
+    const long l = argc > 4 && atol(argv[4]) > 0 ? atol(argv[4])
+                 : std::max(1L, long(double(L) * N * N * N / (double(n) * n * n)));
+    const int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    const int threads = argc > 5 ? atoi(argv[5]) : hardware;
+    const long chains = argc > 6 ? atol(argv[6]) : 4096;
+    const char* storage = argc > 7 ? argv[7] : "malloc";
+    if (!set_multiply_kernel(kernel) || !set_matrix_storage(storage)
+     || n <= 0 || threads <= 0 || chains <= 0
+     || (n != N && !strcmp(mode, "fixed"))) {
+        fprintf(stderr, "Usage: %s [copy|move|into|alloc|chains|tree|dispatch|fixed] "
+                "[naive|ikj|avx2|avx512|auto] [size] [multiplies] [threads] [chains] [malloc|pool|huge]\nfixed only does size %d\n", argv[0], N);
+        return 1;
+    }
+    auto a = Matrix::getRandom(n, n);
     Matrix res = a;
-    for (int i = 0; i < L; ++i) {
-        res = res * a;
+    if (!strcmp(mode, "copy")) {
+        for (long i = 0; i < l; ++i) {
+            res = static_cast<const Matrix&>(res * a);
+        }
+    } else if (!strcmp(mode, "move")) {
+        for (long i = 0; i < l; ++i) {
+            res = res * a;
+        }
+    } else if (!strcmp(mode, "into")) {
+        Matrix tmp(n, n);
+        for (long i = 0; i < l; ++i) {
+            multiply_into(tmp, res, a);
+            std::swap(res, tmp);
+        }
+    } else if (!strcmp(mode, "alloc")) {
+        // The copy loop once per storage, timings on stderr
+        for (const char* alloc_storage : {"malloc", "pool", "huge"}) {
+            set_matrix_storage(alloc_storage);
+            res = a;
+            const auto start = std::chrono::steady_clock::now();
+            for (long i = 0; i < l; ++i) {
+                res = static_cast<const Matrix&>(res * a);
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            fprintf(stderr, "%-6s %.3lf secs\n", alloc_storage, elapsed.count());
+        }
+    } else if (!strcmp(mode, "chains")) {
+        // K independent chains spread over the pool
+        WorkStealingPool pool(threads);
+        const long length = std::max(1L, l / chains);
+        std::vector<Matrix> results(chains, a);
+        const auto start = std::chrono::steady_clock::now();
+        pool.parallel_for(chains, [&](long k) {
+            Matrix chain = a;
+            for (long i = 0; i < length; ++i) {
+                chain = chain * a;
+            }
+            results[k] = std::move(chain);
+        });
+        print_throughput("chains", chains * length, threads, std::chrono::steady_clock::now() - start);
+        res = std::move(results[0]);
+    } else if (!strcmp(mode, "tree")) {
+        // The product of one chain of l matrices, multiplication being
+        // associative: serial products of segments, then pairwise products of
+        // those, a level of the tree at a time.
+        WorkStealingPool pool(threads);
+        const long segments = std::max(1L, std::min(l, long(threads) * 8));
+        std::vector<Matrix> parts(segments, a);
+        const auto start = std::chrono::steady_clock::now();
+        pool.parallel_for(segments, [&](long s) {
+            const long length = l * (s + 1) / segments - l * s / segments;
+            for (long i = 1; i < length; ++i) {
+                parts[s] = parts[s] * a;
+            }
+        });
+        while (parts.size() > 1) {
+            // Products go in place, then the level is packed by moves so
+            // that nothing but multiplies is timed
+            pool.parallel_for(long(parts.size() / 2), [&](long i) {
+                parts[2 * i] = parts[2 * i] * parts[2 * i + 1];
+            });
+            std::vector<Matrix> next;
+            next.reserve((parts.size() + 1) / 2);
+            for (size_t i = 0; i < parts.size(); i += 2) {
+                next.push_back(std::move(parts[i]));
+            }
+            parts = std::move(next);
+        }
+        print_throughput("tree", l - 1, threads, std::chrono::steady_clock::now() - start);
+        res = std::move(parts[0]);
+    } else if (!strcmp(mode, "dispatch")) {
+        run_dispatch(n, l);
+        // Nothing lands in res, there's no corner to print
+        return 0;
+    } else if (!strcmp(mode, "fixed")) {
+        auto fixedA = FixedMatrix<N, N>::getRandom();
+        FixedMatrix<N, N> fixedRes = fixedA;
+        for (long i = 0; i < l; ++i) {
+            fixedRes = fixedRes * fixedA;
+        }
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < N; ++j) {
+                res[i][j] = fixedRes[i][j];
+            }
+        }
+    } else {
+        fprintf(stderr, "Usage: %s [copy|move|into|alloc|chains|tree|dispatch|fixed] "
+                "[naive|ikj|avx2|avx512|auto] [size] [multiplies] [threads] [chains] [malloc|pool|huge]\n", argv[0]);
+        return 1;
     }
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
+    // The top left 16x16 corner is plenty to check the kernels agree
+    for (int i = 0; i < std::min(n, N); ++i) {
+        for (int j = 0; j < std::min(n, N); ++j) {
             printf("%.4lf ", res[i][j]);
         }
         printf("\n");
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Builds every configuration of both variants (see the Makefile) and times
+# them with the same arguments, the original benchmark by default:
+#   ./run_benchmarks.sh [copy|move|into|fixed] [kernel] [size] [multiplies]
+# RUNS=n keeps the best of n runs of each binary.
+
+set -e
+cd "$(dirname "$0")"
+make -s all
+
+runs=${RUNS:-1}
+configs="plain lto wpv final pgo"
+variants="single multiple"
+
+# Best wall time of $runs runs of "$@", in seconds
+best_time() {
+    local best=
+    for ((r = 0; r < runs; ++r)); do
+        local start end
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        end=$(date +%s%N)
+        local ns=$((end - start))
+        if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+            best=$ns
+        fi
+    done
+    printf "%d.%03d" $((best / 1000000000)) $((best / 1000000 % 1000))
+}
+
+echo "Arguments: ${*:-(defaults)}, best of $runs run(s), seconds"
+printf "%-8s" config
+for variant in $variants; do
+    printf " %10s" "$variant"
+done
+printf "\n"
+for config in $configs; do
+    printf "%-8s" "$config"
+    for variant in $variants; do
+        printf " %10s" "$(best_time "build/${variant}_${config}" "$@")"
+    done
+    printf "\n"
+done
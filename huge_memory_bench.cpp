@@ -1,17 +1,45 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include <fstream>
 
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cpuid.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
+#include <linux/magic.h>
+#include <linux/memfd.h>
+#include <linux/mempolicy.h>
 #include <linux/mman.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "bench_harness.h"
+#include "huge_page_arena.h"
 
 // README:
 // Benchmark of initialization and random accesses in a big array of doubles.
@@ -35,12 +63,152 @@
 // Run "head /sys/devices/system/node/node*/hugepages/*-2048kB/free_hugepages"
 // to see the breakdown of free hugetlbfs pages per node (if running on a NUMA
 // box)
+// "--page-size 1g" uses 1GiB hugetlbfs pages instead (32 of them for 32 GiB,
+// see the *-1048576kB pools). The pool is checked before allocating, and the
+// number of pages actually used is printed after the initialization.
 //
 // This program will create a ~1Gib file in /tmp (by default).  Make sure
 // the machine has enough free disk space and remember to remove it when done measuring.
+// The file is binary and gets mmaped as is, so startup is quick once it
+// exists. It records the array size it was generated for and a checksum, and
+// is regenerated automatically when either doesn't match.
+// Alternatively, --seed regenerates the same indices in memory on every run
+// (in parallel, from a counter-based generator) and doesn't need the file.
+//
+// Besides uniform random accesses, --pattern can pick sequential, strided,
+// zipfian or hot set accesses (see -h) to get closer to what a real heap
+// looks like. Those are always generated in memory, from --seed or a random
+// seed that gets printed so the run can be reproduced.
+//
+// The random accesses can be split across several threads with -j. Each
+// thread gets a contiguous slice of the indices and is pinned to its own CPU,
+// so you can see how the TLB savings scale with the number of cores hammering
+// the page walkers at the same time. On NUMA boxes, --cpu-node picks the
+// node(s) the threads run on and --mem-node the node(s) the array is bound to,
+// e.g. "-j 24 --cpu-node 0 --mem-node 1" measures remote accesses only.
+//
+// With "--pattern chase", the array is turned into a random cycle going
+// through every cache line and the timed phase follows it. Every load depends
+// on the previous one, so out-of-order execution can't overlap the misses and
+// the ns per access is the actual load-to-use latency (TLB misses included).
+//
+// Page faults are normally taken by the initialization loop. --prefault
+// faults the array in first (MAP_POPULATE, MADV_POPULATE_WRITE or touching
+// every page) and times that separately from the stores, and --parallel-init
+// spreads both over the -j threads, which is how services usually fix a
+// slow startup.
+//
+// --perf reads hardware counters (cycles, instructions, dTLB and LLC load
+// misses, page faults, page walk cycles) around each phase, to check that a
+// speedup really comes from fewer TLB misses. It needs perf_event_paranoid <= 2
+// and a PMU, so VMs often only get the software events.
+//
+// After the initialization, /proc/self/smaps tells how much of the array
+// actually got huge pages: with THP, fragmentation often leaves part of it
+// on 4KiB pages, which silently skews the results. Runs with less than
+// --min-coverage percent of huge pages are flagged as invalid, and --pagemap
+// double checks every page through /proc/self/pagemap (root only for the
+// page kinds).
+//
+// --kernel runs tuned variants of the random access loop (software
+// prefetching, several independent sums, AVX2/AVX-512 gathers) one after the
+// other on the same mapping, to compare how much "better code" gets back
+// against what "bigger pages" get. "--kernel all" runs every one the CPU
+// supports.
+//
+// The array holds doubles by default. --element makes it floats, pairs of
+// doubles or 64 byte records (one cache line per access, or two with
+// rec64-split) to model real objects, and the indices then pick elements of
+// that size. The kernels are templates instantiated per type.
+//
+// --op makes the accesses write (store, read-modify-write, or atomic
+// fetch_add) instead of only reading, with the same indices, to see what
+// dirty lines and far-memory atomics cost across page sizes and thread
+// counts.
+//
+// The array is anonymous memory by default. --backing maps it from a memfd
+// ("shm"), a new file or a DAX device ("file:PATH", existing files are
+// refused and devices have to hold the whole array), or a new file in a hugetlbfs mount
+// ("hugetlbfs:PATH") instead, to compare the page cache, shmem THP (-m
+// follows /sys/kernel/mm/transparent_hugepage/shmem_enabled) and hugetlbfs
+// files with what the caches living in shared memory see.
+//
+// The list of indices is memory too: 8 bytes per access, streamed through
+// the same caches and TLBs as the array. --indices u32 halves that, and
+// --indices inline computes the uniform indices in the loop from the seed
+// (the same ones, so the result doesn't change), to see how much of a
+// measurement is the index stream's own footprint.
+//
+// Averages hide the tail. --latency times the same accesses again with
+// rdtscp, one by one or in --latency-batch batches, and prints the
+// p50/p99/p99.9/max of a log-linear histogram so TLB misses and page walks
+// show up as outliers per page size.
+//
+// In production the huge pages compete with other tenants. --antagonists
+// runs threads that keep faulting 4KiB pages in and freeing every other one
+// during each run, and --compact-every triggers compactions on top, so the
+// THP fault times and TLB gains can be measured under contention. With -m or
+// either of those, the /proc/vmstat THP fault and compaction counters of each
+// run are printed (thp_fault_fallback tells how many THP faults got 4KiB
+// pages instead).
+//
+// --sweep finds where huge pages start to pay off in one go: after the
+// initialization, the access phase runs over the first 32kB of the array,
+// then 64kB... up to the whole array, and prints ns per access for each
+// size. Run it once per page size (or let bench_runner sweep "page") to get
+// one curve each, the L1 dTLB, STLB and cache reach show up as steps. -s
+// takes sizes like "512m" too.
+//
+// --collapse answers whether to rely on khugepaged or to collapse eagerly:
+// the array is faulted in with 4kB pages, then gets THP in --collapse-rounds
+// rounds, either with MADV_COLLAPSE on the next part of the array (madvise)
+// or by leaving khugepaged --collapse-interval ms (khugepaged), and the
+// access phase runs again after each round. The time of each round, the THP
+// coverage it got to and the thp_collapse_* counters are printed along with
+// the access times. The THP settings that matter (enabled, defrag,
+// khugepaged/*) are printed with -m and --collapse.
+//
+// --stream measures sequential bandwidth on the same mapping, which the
+// initialization doesn't (it also takes the page faults and does a modulo
+// per element): after the access phase the array is split in three arrays
+// of doubles and the STREAM copy, scale, add and triad kernels run over them
+// with the -j threads, with plain loops, SSE2 non-temporal stores, AVX-512
+// stores or AVX-512 non-temporal stores. Like STREAM, GB/s counts the bytes
+// the kernel reads and writes, not the reads of store misses, so regular
+// stores look slower than non-temporal ones by about that much. Run it with
+// each page size to see if bulk copies care about huge pages:
+//   huge_memory_bench -s 4 --stream all
+//   huge_memory_bench -s 4 -m --stream all
+//
+// --processes N is the many workers attached to one big shared book: once
+// the array is initialized, N forked reader processes run the access phase
+// at the same time on the mapping they inherited. Each one reports how long
+// its fork took, its access time and its page tables (VmPTE) at the end.
+// With --backing shm or hugetlbfs the array is MAP_SHARED: fork doesn't copy
+// its page tables, every reader faults in its own, which the access time
+// includes, and VmPTE shows what 2MB or 1GB pages save per process. With
+// the default anonymous mapping the readers share it copy on write, fork
+// copies the page tables and --op write times the copies.
+//   huge_memory_bench -s 8 --seed 1 --backing shm --processes 8
+//   huge_memory_bench -s 8 --seed 1 -t --backing hugetlbfs:/dev/hugepages
+//       --processes 8
+//
+// For regression tracking, --repeat N maps, initializes and accesses a fresh
+// array N times and reports min/median/p99 per phase, and --format json (or
+// csv) prints that along with the config, the kernel version and the
+// /sys/kernel/mm/transparent_hugepage settings on stdout, ready to be
+// ingested by a dashboard. The progress messages go to stderr then.
+//
+// The array is mapped with huge_page_arena.h, the header services use to get
+// huge pages (with a 1G, 2M, THP, 4K fallback, which the benchmark turns
+// off), so what gets measured is the code path that ships.
+//
+// The same runs are registered as the memory/access case of bench_runner
+// (see bench_runner.cpp), which sweeps them along with the devirtualisation
+// benchmarks with shared warmup, iterations and JSON output.
 //
 // Build:
-// clang++/g++ -Wall -W -g -O2 -o huge_memory_bench huge_memory_bench.cpp
+// clang++/g++ -Wall -W -g -O2 -pthread -o huge_memory_bench huge_memory_bench.cpp
 
 #if __cplusplus < 201103L
 #error "Compile with -std=c++11 or later"
@@ -50,227 +218,3931 @@
 // accesses into the array every time
 #define CACHED_INDICES_FILE "/tmp/mem_bench_indices"
 
+// CACHED_INDICES_FILE is a page-sized header followed by the raw indices, so
+// it can be mmaped and used as is. Bump the version whenever the layout or
+// the way indices are generated changes.
+#define INDICES_FILE_MAGIC "HRTIDX\0"
+#define INDICES_FILE_VERSION 1
+#define INDICES_FILE_DATA_OFFSET 4096UL
+
 using namespace std;
+using harness::Stats;
+using harness::computeStats;
+using harness::jsonString;
+using hugepages::Residency;
+using hugepages::readSmaps;
+
+struct IndicesFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dataOffset;
+    // Array size the indices were generated for, in elements
+    uint64_t endIdx;
+    // Number of indices following the header
+    uint64_t count;
+    // Seed of the generator, so a run can be reproduced
+    uint64_t seed;
+    // indicesChecksum() of the indices
+    uint64_t checksum;
+};
+
+// The indices of the random accesses, mapped from CACHED_INDICES_FILE or
+// generated in an anonymous mapping.
+struct Indices {
+    const unsigned long *data = nullptr;
+    // Instead of data with --indices u32
+    const uint32_t *data32 = nullptr;
+    unsigned long size = 0;
+    void *map = MAP_FAILED;
+    size_t mapSize = 0;
+
+    Indices() = default;
+    Indices(const Indices &) = delete;
+    Indices &operator=(const Indices &) = delete;
+    ~Indices() { unmap(); }
+
+    void unmap()
+    {
+        if (map != MAP_FAILED)
+            munmap(map, mapSize);
+        map = MAP_FAILED;
+        data = nullptr;
+        data32 = nullptr;
+        size = 0;
+    }
+};
+
+// FNV-1a over the 64-bit indices. Catches truncated or corrupted files.
+uint64_t indicesChecksum(const unsigned long *indices, unsigned long count)
+{
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (unsigned long i = 0; i < count; ++i) {
+        hash = (hash ^ indices[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
 
 // Randomly generate a new list of indices to access for the benchmark
-bool generateIndices(vector<unsigned long> *indices, unsigned long endIdx, unsigned long numIndices)
+bool generateIndices(Indices *indices, unsigned long endIdx, unsigned long numIndices)
 {
-    FILE *fd = fopen(CACHED_INDICES_FILE, "w");
-    if (!fd) {
-        printf("Can't open %s for writing\n", CACHED_INDICES_FILE);
+    // Generate into a temporary file that gets renamed once complete, so an
+    // interrupted run never leaves a half written file behind.
+    const string tmpPath = string(CACHED_INDICES_FILE) + ".tmp";
+    const size_t fileSize = INDICES_FILE_DATA_OFFSET
+                          + numIndices * sizeof(unsigned long);
+    int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Can't open %s for writing\n", tmpPath.c_str());
+        return false;
+    }
+    if (ftruncate(fd, fileSize)) {
+        perror("Can't size the indices file");
+        close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    void *map = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Can't map the indices file");
+        unlink(tmpPath.c_str());
         return false;
     }
+    unsigned long *out = (unsigned long *) ((char *) map + INDICES_FILE_DATA_OFFSET);
 
-    mt19937_64 rng;
     random_device rdev;
-    rng.seed(rdev());
+    const uint64_t seed = (uint64_t(rdev()) << 32) | rdev();
+    mt19937_64 rng(seed);
 
-    // Random indices into the array
+    // Random indices into the array, stored straight into the file so
+    // subsequent runs do the same exact accesses
     uniform_int_distribution<mt19937_64::result_type> dist(0, endIdx - 1);
     for (unsigned long i = 0; i < numIndices; ++i) {
-        unsigned long idx = dist(rng);
-        // Store both in the vector and the file so subsequent runs do the same
-        // exact accesses
-        fprintf(fd, "%lu\n", idx);
-        indices->emplace_back(idx);
+        out[i] = dist(rng);
+    }
+
+    IndicesFileHeader *header = (IndicesFileHeader *) map;
+    memcpy(header->magic, INDICES_FILE_MAGIC, sizeof(header->magic));
+    header->version = INDICES_FILE_VERSION;
+    header->dataOffset = INDICES_FILE_DATA_OFFSET;
+    header->endIdx = endIdx;
+    header->count = numIndices;
+    header->seed = seed;
+    header->checksum = indicesChecksum(out, numIndices);
+
+    if (rename(tmpPath.c_str(), CACHED_INDICES_FILE)) {
+        perror("Can't rename the indices file");
+        munmap(map, fileSize);
+        unlink(tmpPath.c_str());
+        return false;
     }
     // Done
-    fclose(fd);
-    printf("Generated %s. Remember to remove it when done running benchmarks\n",
-           CACHED_INDICES_FILE);
+    indices->map = map;
+    indices->mapSize = fileSize;
+    indices->data = out;
+    indices->size = numIndices;
+    printf("Generated %s (seed %lu). Remember to remove it when done running "
+           "benchmarks\n", CACHED_INDICES_FILE, (unsigned long) seed);
+    return true;
+}
+
+// splitmix64 finalizer. Hashing a counter with it gives a counter-based
+// generator: element i of a sequence only depends on the seed and i, so the
+// sequence can be generated in any order and by any number of threads.
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+// i-th random number of the sequence identified by seed
+static inline uint64_t seededRandom(uint64_t seed, uint64_t i)
+{
+    return splitmix64(seed ^ (i * 0xd1342543de82ef95UL));
+}
+
+// Map a 64-bit random number to [0, bound) with a multiply instead of a
+// modulo. The bias is at most bound / 2^64, irrelevant here.
+static inline uint64_t boundedRandom(uint64_t rnd, uint64_t bound)
+{
+    return (uint64_t) (((unsigned __int128) rnd * bound) >> 64);
+}
+
+// Parameters of the access patterns, set from the command line.
+struct PatternParams {
+    // One past the last valid index in the array
+    unsigned long endIdx = 0;
+    uint64_t seed = 0;
+    // stride: distance between two accesses, in elements
+    unsigned long stride = 0;
+    // zipf: skew (exponent) of the distribution, and the multiplier
+    // scattering the ranks over the array (coprime with endIdx)
+    double zipfSkew = 0.0;
+    unsigned long zipfScatter = 1;
+    // hotset: number of elements at the start of the array being accessed
+    unsigned long hotSetIdx = 0;
+};
+
+// An access pattern maps the position of an access in the timed loop to an
+// index into the array. Patterns are counter-based like seededRandom(), so
+// the indices can be generated by any number of threads in any order.
+struct AccessPattern {
+    const char *name;
+    const char *help;
+    // nullptr for the patterns that don't use a list of indices
+    unsigned long (*index)(const PatternParams &params, unsigned long i);
+};
+
+unsigned long uniformIndex(const PatternParams &params, unsigned long i)
+{
+    return boundedRandom(seededRandom(params.seed, i), params.endIdx);
+}
+
+unsigned long sequentialIndex(const PatternParams &params, unsigned long i)
+{
+    return i % params.endIdx;
+}
+
+unsigned long strideIndex(const PatternParams &params, unsigned long i)
+{
+    return (unsigned long) (((unsigned __int128) i * params.stride)
+                            % params.endIdx);
+}
+
+// Ranks follow a power law, rank r being accessed with a probability
+// proportional to 1 / r^skew. The inverse of the (continuous) CDF is applied
+// to a uniform number, which is close enough to a discrete Zipf distribution
+// with that many elements. Ranks are then scattered over the array: hot
+// elements of a real heap aren't all in the same pages either.
+unsigned long zipfIndex(const PatternParams &params, unsigned long i)
+{
+    // 53 random bits in [0, 1), hex float literals are C++17
+    const double u = ldexp(double(seededRandom(params.seed, i) >> 11), -53);
+    const double n = double(params.endIdx);
+    double rank;
+    if (fabs(params.zipfSkew - 1.0) < 1e-9) {
+        rank = exp(u * log(n + 1.0)) - 1.0;
+    } else {
+        const double e = 1.0 - params.zipfSkew;
+        rank = pow(1.0 + u * (pow(n + 1.0, e) - 1.0), 1.0 / e) - 1.0;
+    }
+    const unsigned long r = min((unsigned long) rank, params.endIdx - 1);
+    return (unsigned long) (((unsigned __int128) r * params.zipfScatter)
+                            % params.endIdx);
+}
+
+unsigned long hotSetIndex(const PatternParams &params, unsigned long i)
+{
+    return boundedRandom(seededRandom(params.seed, i), params.hotSetIdx);
+}
+
+static const AccessPattern accessPatterns[] = {
+    {"uniform", "independent loads at random indices (default)", uniformIndex},
+    {"sequential", "consecutive elements from the start of the array",
+     sequentialIndex},
+    {"stride", "one access every --stride bytes, wrapping around",
+     strideIndex},
+    {"zipf", "Zipf distributed indices with skew --zipf-skew, hot elements "
+     "scattered over the array", zipfIndex},
+    {"hotset", "random indices within the first --hot-set MiB of the array",
+     hotSetIndex},
+    {"chase", "dependent loads following a random cycle through every cache "
+     "line of the array, reports the latency per access", nullptr},
+};
+
+const AccessPattern *findPattern(const char *name)
+{
+    for (const AccessPattern &pattern : accessPatterns) {
+        if (!strcmp(pattern.name, name))
+            return &pattern;
+    }
+    return nullptr;
+}
+
+// Smallest multiplier at or above the golden ratio of n that is coprime with
+// n, so multiplying by it modulo n is a permutation of [0, n).
+unsigned long coprimeScatter(unsigned long n)
+{
+    unsigned long mult = (unsigned long) (n * 0.6180339887) | 1;
+    for (;;) {
+        unsigned long a = mult, b = n;
+        while (b) {
+            const unsigned long r = a % b;
+            a = b;
+            b = r;
+        }
+        if (a == 1)
+            return mult;
+        mult += 2;
+    }
+}
+
+// Generate the indices of pattern in memory, split across numThreads
+// threads. The same parameters (seed included) and number of indices always
+// give the same indices, whatever the number of threads.
+bool generateSeededIndices(Indices *indices, const AccessPattern &pattern,
+                           const PatternParams &params,
+                           unsigned long numIndices, unsigned long numThreads,
+                           bool narrow = false)
+{
+    const size_t size = numIndices * (narrow ? sizeof(uint32_t)
+                                             : sizeof(unsigned long));
+    void *map = mmap(nullptr, max(size, (size_t) 1), PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("Can't allocate the indices");
+        return false;
+    }
+    unsigned long *out = (unsigned long *) map;
+    uint32_t *out32 = (uint32_t *) map;
+
+    vector<thread> threads;
+    for (unsigned long t = 0; t < numThreads; ++t) {
+        const unsigned long begin = numIndices * t / numThreads;
+        const unsigned long end = numIndices * (t + 1) / numThreads;
+        threads.emplace_back([=, &pattern, &params] {
+            for (unsigned long i = begin; i < end; ++i) {
+                if (narrow)
+                    out32[i] = pattern.index(params, i);
+                else
+                    out[i] = pattern.index(params, i);
+            }
+        });
+    }
+    for (thread &th : threads) {
+        th.join();
+    }
+
+    indices->map = map;
+    indices->mapSize = max(size, (size_t) 1);
+    if (narrow)
+        indices->data32 = out32;
+    else
+        indices->data = out;
+    indices->size = numIndices;
     return true;
 }
 
-// Try to read CACHED_INDICES_FILE. If it's missing or contains invalid data,
-// generate a new one.
-bool readIndices(vector<unsigned long> *indices, unsigned long endIdx,
+// Try to map CACHED_INDICES_FILE. If it's missing, was generated for a
+// different array size or number of indices, or is corrupted, generate a new
+// one.
+bool readIndices(Indices *indices, unsigned long endIdx,
                  unsigned long numIndices)
 {
-    // Reserve in advance so we don't do a gazillion reallocs.
-    indices->reserve(numIndices);
-    FILE *fd = fopen(CACHED_INDICES_FILE, "r");
-    if (!fd) {
+    int fd = open(CACHED_INDICES_FILE, O_RDONLY);
+    if (fd < 0) {
         // Most likely the file does not exist, generate a new one.
         return generateIndices(indices, endIdx, numIndices);
     }
 
-    // Read the file line by line (one index per line)
-    char buf[128];
-    unsigned long maxIdx = 0;
-    while (fgets(buf, sizeof(buf), fd)) {
-        char *endPtr;
-        long idx = strtol(buf, &endPtr, 10);
+    struct stat st;
+    const size_t fileSize = INDICES_FILE_DATA_OFFSET
+                          + numIndices * sizeof(unsigned long);
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t) st.st_size == fileSize) {
+        // Populate so the timed loop doesn't take page faults on the indices.
+        map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                   fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        puts("Invalid file, regenerating");
+        return generateIndices(indices, endIdx, numIndices);
+    }
+    indices->map = map;
+    indices->mapSize = fileSize;
+    indices->data = (const unsigned long *) ((char *) map + INDICES_FILE_DATA_OFFSET);
+    indices->size = numIndices;
 
-        // Validate idx
-        if ((*endPtr != '\n' && *endPtr) || idx < 0
-         || (unsigned long) idx >= endIdx) {
-            printf("invalid line: %s", buf);
-            break;
+    const IndicesFileHeader *header = (const IndicesFileHeader *) map;
+    if (memcmp(header->magic, INDICES_FILE_MAGIC, sizeof(header->magic))
+     || header->version != INDICES_FILE_VERSION
+     || header->dataOffset != INDICES_FILE_DATA_OFFSET
+     || header->endIdx != endIdx || header->count != numIndices
+     || header->checksum != indicesChecksum(indices->data, numIndices)) {
+        // Generated for a different array size or corrupted, get a new one.
+        puts("Invalid file, regenerating");
+        indices->unmap();
+        return generateIndices(indices, endIdx, numIndices);
+    }
+    return true;
+}
+
+// Parse a size such as "32k", "512m" or "4g" (binary units, case
+// insensitive) into bytes. Without a suffix, the number is in GiB.
+bool parseSize(const char *str, unsigned long *bytes)
+{
+    char *endPtr;
+    const unsigned long num = strtoul(str, &endPtr, 0);
+    if (endPtr == str)
+        return false;
+    unsigned long shift;
+    switch (tolower(*endPtr)) {
+        case 'k': shift = 10; break;
+        case 'm': shift = 20; break;
+        case 'g': case '\0': shift = 30; break;
+        default: return false;
+    }
+    if (*endPtr && endPtr[1])
+        return false;
+    if (num > (~0UL >> shift))
+        return false;
+    *bytes = num << shift;
+    return true;
+}
+
+// The other way around, in the biggest unit that divides bytes: "32k",
+// "1m", "3g"
+string sizeString(unsigned long bytes)
+{
+    static const char units[] = "kmg";
+    int unit = -1;
+    while (unit < 2 && bytes >= 1024 && bytes % 1024 == 0) {
+        bytes /= 1024;
+        ++unit;
+    }
+    return to_string(bytes) + (unit < 0 ? "" : string(1, units[unit]));
+}
+
+// Parse a list of integers such as "0-3,8,10-11" (the format used by
+// /sys/devices/system/node/node*/cpulist) into *out.
+bool parseList(const char *str, vector<int> *out)
+{
+    while (*str && *str != '\n') {
+        char *endPtr;
+        long first = strtol(str, &endPtr, 10);
+        long last = first;
+        if (endPtr == str || first < 0)
+            return false;
+        if (*endPtr == '-') {
+            str = endPtr + 1;
+            last = strtol(str, &endPtr, 10);
+            if (endPtr == str || last < first)
+                return false;
         }
+        for (long i = first; i <= last; ++i)
+            out->push_back(i);
+        str = endPtr;
+        if (*str == ',')
+            ++str;
+        else if (*str && *str != '\n')
+            return false;
+    }
+    return true;
+}
 
-        // Store in the vector
-        indices->emplace_back(idx);
-        maxIdx = max(maxIdx, (unsigned long)idx);
-        if (indices->size() > numIndices)
-            break;
+// Parse a comma separated list of names of entries of table, or "all" for
+// every entry, into *out. False on an unknown name.
+template <typename T, size_t N>
+bool parseNames(const char *str, const T (&table)[N], vector<const T *> *out,
+                bool *all)
+{
+    out->clear();
+    *all = !strcmp(str, "all");
+    if (*all) {
+        for (const T &entry : table)
+            out->push_back(&entry);
+        return true;
     }
-    fclose(fd);
+    const string list = str;
+    size_t pos = 0;
+    do {
+        const size_t comma = list.find(',', pos);
+        const string name = list.substr(pos, comma - pos);
+        size_t i = 0;
+        while (i < N && name != table[i].name)
+            ++i;
+        if (i == N)
+            return false;
+        out->push_back(&table[i]);
+        pos = comma == string::npos ? comma : comma + 1;
+    } while (pos != string::npos);
+    return true;
+}
 
-    // Try to see if we generated indices for a different array size or if the
-    // file was truncated or too big
-    if ((endIdx - maxIdx) > 10000000 || indices->size() != numIndices) {
-        // Get a new one.
-        puts("Invalid file, regenerating");
-        indices->clear();
-        return generateIndices(indices, endIdx, numIndices);
+// Drop the entries of *list this CPU can't run, saying so, if they came from
+// "all". False if one was asked for by name.
+template <typename T>
+bool keepSupported(vector<const T *> *list, bool all, const char *what)
+{
+    for (size_t i = 0; i < list->size(); ++i) {
+        const T *entry = (*list)[i];
+        if (entry->supported())
+            continue;
+        if (!all) {
+            printf("This CPU doesn't support %s %s\n", what, entry->name);
+            return false;
+        }
+        printf("Skipping %s %s, not supported by this CPU\n", what, entry->name);
+        list->erase(list->begin() + i--);
     }
     return true;
 }
 
-void usage(char *name) {
-    printf("Usage: %s [-h] [-s sizeInGib] [-m] [-t]\n", name);
-    puts("Options");
-    puts(" -h: display usage");
-    puts(" -m: madvise the memory with MADV_HUGEPAGE (THP), conflicts with -t");
-    puts(" -s sizeInGib: array size, default is 32Gib, max 128Gib");
-    puts(" -t: allocate the array with MAP_HUGETLB (hugetlbfs), conflicts "
-         "with -m");
-    exit(1);
+// Fill *cpus with the CPUs the threads should be pinned to: the CPUs of the
+// given NUMA nodes if any, otherwise every CPU we're allowed to run on.
+bool getCpus(const vector<int> &nodes, vector<int> *cpus)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        perror("sched_getaffinity");
+        return false;
+    }
+
+    vector<int> candidates;
+    if (nodes.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            candidates.push_back(cpu);
+    }
+    for (int node : nodes) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        ifstream ifs(path);
+        string str;
+        if (!ifs || !getline(ifs, str) || !parseList(str.c_str(), &candidates)) {
+            printf("Can't read the CPUs of NUMA node %d from %s\n", node, path);
+            return false;
+        }
+    }
+    for (int cpu : candidates) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+            cpus->push_back(cpu);
+    }
+    if (cpus->empty()) {
+        puts("No usable CPU to run the benchmark threads on");
+        return false;
+    }
+    return true;
 }
 
-int main(int argc, char **argv)
+// Free pages in the hugetlbfs pool of pageSizeKib pages, summed over the
+// given NUMA nodes or system wide if there are none. -1 if the pool doesn't
+// exist, i.e. the kernel or CPU doesn't support that page size.
+long freeHugePages(unsigned long pageSizeKib, const vector<int> &nodes)
 {
-    // Default size of the array: 32GiB, i.e 4Gi doubles
-    unsigned long arraySize = 32U*1024UL*1024UL*1024UL;
+    vector<string> paths;
+    if (nodes.empty()) {
+        paths.push_back("/sys/kernel/mm/hugepages/hugepages-"
+                        + to_string(pageSizeKib) + "kB/free_hugepages");
+    }
+    for (int node : nodes) {
+        paths.push_back("/sys/devices/system/node/node" + to_string(node)
+                        + "/hugepages/hugepages-" + to_string(pageSizeKib)
+                        + "kB/free_hugepages");
+    }
+    long total = 0;
+    for (const string &path : paths) {
+        ifstream ifs(path);
+        long pages;
+        if (!(ifs >> pages))
+            return -1;
+        total += pages;
+    }
+    return total;
+}
 
-    // One past last valid index in the array.
-    unsigned long endIdx = arraySize / sizeof(double);
+// Raw event counting the cycles during which a page walk caused by a load is
+// in progress: DTLB_LOAD_MISSES.WALK_ACTIVE on Intel since Skylake. There's
+// no generic perf event for it, and other vendors need --perf-walk-event.
+#define INTEL_WALK_ACTIVE_EVENT 0x1008
 
-    bool hugetlb = false, thp = false;
-    char opt;
-    while ((opt = getopt(argc, argv, "hmts:")) != -1) {
-        switch (opt) {
-            case 'h':
-                usage(argv[0]);
-                break;
-            case 't':
-                hugetlb = true;
-                break;
-            case 'm': {
-                thp = true;
-                ifstream ifs("/sys/kernel/mm/transparent_hugepage/enabled");
-                bool enabled = false;
-                if (ifs) {
-                    string str;
-                    if (getline(ifs, str)
-                      && str.find("[never]") == string::npos) {
-                        enabled = true;
-                    }
-                }
-                if (!enabled) {
-                    puts("Tranparent Huge Pages are not enabled. Switch "
-                         "/sys/kernel/mm/transparent_hugepage to either "
-                         "madvise or always (madvise recommended for this "
-                         "test)");
-                    return 1;
-                }
-            } break;
-            case 's': {
-                // Override the array size using the 1st arg if present.  It's
-                // passed in GiB.
-                char *endPtr;
-                const unsigned long num  = strtoul(optarg, &endPtr, 0);
-                if (*endPtr || num > 128) {
-                    // No more than 128 GiB. It's arbitrary to avoid passing
-                    // really large amounts.
-                    usage(argv[0]);
-                }
-                arraySize = num * 1024UL * 1024UL * 1024UL;
-                endIdx = arraySize / sizeof(double);
-                break;
+// Optional hardware counters around the timed phases (--perf). Counters
+// only count the thread that opened them: threads of a phase open their own
+// set with openLike(), and merge() the counts into the phase total when done.
+struct PerfCounters {
+    struct Counter {
+        const char *name;
+        int fd;
+        uint64_t value;
+        // Time the counter was enabled and actually counting, running is
+        // less than enabled when the PMU is multiplexed
+        uint64_t enabled, running;
+    };
+    vector<Counter> counters;
+    // Raw config of the page walk cycles event, 0 if none
+    uint64_t walkEvent = 0;
+    mutex lock;
+
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+    ~PerfCounters()
+    {
+        for (Counter &counter : counters) {
+            if (counter.fd >= 0)
+                close(counter.fd);
+        }
+    }
+
+    void add(const char *name, uint32_t type, uint64_t config, bool verbose)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            // perf_event_paranoid > 1, user space only then
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        if (fd < 0 && verbose) {
+            printf("Can't count %s: %s\n", name, strerror(errno));
+        }
+        counters.push_back(Counter{name, fd, 0, 0, 0});
+    }
+
+    // walkEvent_ is the raw config of the page walk cycles event, 0 to use
+    // the default of the CPU if it has one
+    void open(uint64_t walkEvent_, bool verbose)
+    {
+        walkEvent = walkEvent_;
+        add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, verbose);
+        add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+            verbose);
+        add("dTLB-load-misses", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), verbose);
+        add("LLC-load-misses", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), verbose);
+        add("page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,
+            verbose);
+        if (!walkEvent) {
+            unsigned int eax, ebx, ecx, edx;
+            // "GenuineIntel" is in ebx, edx, ecx
+            if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) && ebx == 0x756e6547
+             && edx == 0x49656e69 && ecx == 0x6c65746e) {
+                walkEvent = INTEL_WALK_ACTIVE_EVENT;
             }
-            default: usage(argv[0]);
+        }
+        if (walkEvent) {
+            add("page-walk-cycles", PERF_TYPE_RAW, walkEvent, verbose);
+        } else if (verbose) {
+            puts("No known page walk cycles event for this CPU, use "
+                 "--perf-walk-event");
         }
     }
-    if ((hugetlb & thp) || optind != argc) {
-        usage(argv[0]);
+
+    // Open the same counters as other, for the calling thread. Does nothing
+    // if other isn't counting anything.
+    void openLike(const PerfCounters &other)
+    {
+        if (!other.counters.empty())
+            open(other.walkEvent, false);
     }
 
-    // Number of accesses into the array we'll bench: 3% of the total
-    unsigned long numIndices = endIdx * 0.03;
+    void clear()
+    {
+        for (Counter &counter : counters) {
+            counter.value = counter.enabled = counter.running = 0;
+        }
+    }
 
-    vector<unsigned long> indices;
-    puts("Getting the indices");
-    if (!readIndices(&indices, endIdx, numIndices)) {
-        puts("Can't get indices");
-        return 1;
+    void start()
+    {
+        clear();
+        for (Counter &counter : counters) {
+            if (counter.fd >= 0) {
+                ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
     }
 
-    int flags = MAP_ANONYMOUS | MAP_PRIVATE;
-    if (hugetlb)
-        flags |= MAP_HUGETLB | MAP_HUGE_2MB;
-    void * const mem = mmap(nullptr, arraySize, PROT_READ|PROT_WRITE, flags,
-            -1, 0);
-    if (mem == MAP_FAILED) {
-        perror("Cannot allocate memory!");
-        if (hugetlb) {
-            puts("You must have at least 16Gi free hugetlbfs pages. "
-                 "Check /proc/meminfo to see the number of free hugetlbfs"
-                 "pages and adjust if necessary with hugeadm");
+    void stop()
+    {
+        for (Counter &counter : counters) {
+            if (counter.fd < 0)
+                continue;
+            ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t buf[3];
+            if (read(counter.fd, buf, sizeof(buf)) != sizeof(buf) || !buf[2])
+                continue;
+            // Scale up if the counter was multiplexed
+            counter.value = uint64_t(buf[0] * (double(buf[1]) / buf[2]));
+            counter.enabled = buf[1];
+            counter.running = buf[2];
         }
-        return 1;
     }
-    if (thp) {
-        if (madvise(mem, arraySize, MADV_HUGEPAGE)) {
-            puts("madvise MADV_HUGEPAGE failed, enable THP and try again");
-            return 1;
+
+    // Add the counts of other (from another thread) to ours
+    void merge(const PerfCounters &other)
+    {
+        lock_guard<mutex> guard(lock);
+        for (Counter &counter : counters) {
+            for (const Counter &theirs : other.counters) {
+                if (!strcmp(counter.name, theirs.name) && theirs.fd >= 0) {
+                    counter.value += theirs.value;
+                    counter.enabled += theirs.enabled;
+                    counter.running += theirs.running;
+                }
+            }
         }
-    } else if (!hugetlb) {
-        madvise(mem, arraySize, MADV_NOHUGEPAGE);
     }
 
-    double * const array = (double *) mem;
+    const Counter *find(const char *name) const
+    {
+        for (const Counter &counter : counters) {
+            if (!strcmp(counter.name, name) && counter.fd >= 0)
+                return &counter;
+        }
+        return nullptr;
+    }
 
-    // Initialize the array. You won't see a dramatic difference in terms of
-    // performance between 4K and 2MB pages because the array is initialized
-    // linearly.
-    puts("Initializing the array");
-    chrono::time_point<chrono::system_clock> startTime, endTime;
-    startTime = chrono::system_clock::now();
-    asm volatile ("" ::: "memory");
-    for (unsigned long i = 0; i < endIdx; ++i) {
-        // We're going to add a lot of doubles so we generate fairly small
-        // numbers.
-        array[i] = 1e-9 * double(i % 79);
+    // Print the counts of the last phase, per access too if numAccesses
+    void print(const char *phase, unsigned long numAccesses) const
+    {
+        for (const Counter &counter : counters) {
+            if (counter.fd < 0)
+                continue;
+            printf("%s %s: %lu", phase, counter.name,
+                   (unsigned long) counter.value);
+            if (numAccesses)
+                printf(" (%.3lf per access)", double(counter.value) / numAccesses);
+            if (counter.running < counter.enabled)
+                printf(" [scaled, counted %.0lf%% of the time]",
+                       100.0 * counter.running / counter.enabled);
+            putchar('\n');
+        }
+        const Counter *cycles = find("cycles");
+        const Counter *instructions = find("instructions");
+        if (cycles && instructions && cycles->value) {
+            printf("%s IPC: %.3lf\n", phase,
+                   double(instructions->value) / cycles->value);
+        }
     }
-    asm volatile ("" ::: "memory");
-    endTime = chrono::system_clock::now();
-    chrono::duration<double> elapsed = endTime - startTime;
-    printf("Initialization of the array took %.4lf secs\n", elapsed.count());
+};
+
+// What /proc/self/pagemap (and /proc/kpageflags) say about the 4KiB pages of
+// a range of memory.
+struct PageMapCounts {
+    unsigned long pages = 0;
+    unsigned long present = 0;
+    // Present pages for which we got a PFN: without CAP_SYS_ADMIN the kernel
+    // hides them and the kind of page is unknown.
+    unsigned long withPfn = 0;
+    unsigned long thp = 0;
+    unsigned long hugetlb = 0;
+};
+
+#define PAGEMAP_PRESENT (1UL << 63)
+#define PAGEMAP_PFN_MASK ((1UL << 55) - 1)
+#define KPF_HUGE_BIT 17
+#define KPF_THP_BIT 22
+
+bool readPageMap(const void *addr, unsigned long size, PageMapCounts *counts)
+{
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+        perror("Can't open /proc/self/pagemap");
+        return false;
+    }
+    // Only readable by root, fine without it
+    int flagsFd = open("/proc/kpageflags", O_RDONLY);
+
+    const unsigned long firstPage = (unsigned long) addr / 4096;
+    const unsigned long numPages = size / 4096;
+    vector<uint64_t> entries(65536);
+    for (unsigned long done = 0; done < numPages;) {
+        const unsigned long chunk = min(numPages - done, (unsigned long) entries.size());
+        const ssize_t len = pread(fd, entries.data(), chunk * sizeof(uint64_t),
+                                  (firstPage + done) * sizeof(uint64_t));
+        if (len != (ssize_t) (chunk * sizeof(uint64_t))) {
+            perror("Can't read /proc/self/pagemap");
+            close(fd);
+            if (flagsFd >= 0)
+                close(flagsFd);
+            return false;
+        }
+        for (unsigned long i = 0; i < chunk; ++i) {
+            if (!(entries[i] & PAGEMAP_PRESENT))
+                continue;
+            ++counts->present;
+            const uint64_t pfn = entries[i] & PAGEMAP_PFN_MASK;
+            uint64_t flags;
+            if (!pfn || flagsFd < 0
+             || pread(flagsFd, &flags, sizeof(flags), pfn * sizeof(flags))
+                != sizeof(flags)) {
+                continue;
+            }
+            ++counts->withPfn;
+            if (flags & (1UL << KPF_THP_BIT)) {
+                ++counts->thp;
+            } else if (flags & (1UL << KPF_HUGE_BIT)) {
+                ++counts->hugetlb;
+            }
+        }
+        done += chunk;
+    }
+    counts->pages = numPages;
+    close(fd);
+    if (flagsFd >= 0)
+        close(flagsFd);
+    return true;
+}
 
+// What one thread of the random access phase did.
+struct ThreadResult {
+    int cpu = -1;
     double result = 0.0;
+    // Where the pointer chase ended
+    unsigned long lastIdx = 0;
+    chrono::time_point<chrono::steady_clock> startTime, endTime;
+};
 
-    // What we're really timing: randomly generated accesses into the double
-    // array.  We're computing result to make sure all runs are consistent but
-    // also so the compiler does not get too clever and removes the code
-    // we're trying to measure.
+// Pin the calling thread to cpu, if not -1
+void pinThread(int cpu)
+{
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            printf("Can't pin thread to CPU %d\n", cpu);
+        }
+    }
+}
 
-    startTime = chrono::system_clock::now();
-    asm volatile ("" ::: "memory");
-    for (unsigned long u : indices) {
-        result += array[u];
+// Pin the calling thread to cpu (if not -1) and wait for every other thread
+// to be ready, so they all hit the memory at the same time.
+void pinAndWait(int cpu, atomic<int> *ready, ThreadResult *res)
+{
+    pinThread(cpu);
+    res->cpu = sched_getcpu();
+    ready->fetch_sub(1);
+    while (ready->load() > 0) {
     }
-    asm volatile ("" ::: "memory");
-    endTime = chrono::system_clock::now();
+}
 
-    elapsed = endTime - startTime;
+// What each access does to its element
+enum Op {
+    OP_READ,
+    OP_WRITE,
+    OP_RMW,
+    OP_ATOMIC,
+};
+static const char * const opNames[] = {
+    "read", "write", "rmw", "atomic",
+};
 
-    printf("Adding took %.4lf secs\n", elapsed.count());
-    // The result is interesting just to double check that every run is
-    // adding the same doubles.
-    printf("Result is %lf\n", result);
+// Element types of the array, to model objects bigger than a double. The
+// kernels are instantiated for each one, so the loops never look at the type.
+enum Element {
+    ELEMENT_F32,
+    ELEMENT_F64,
+    ELEMENT_V16,
+    ELEMENT_REC64,
+    ELEMENT_REC64_SPLIT,
+    NUM_ELEMENTS,
+};
+struct ElementType {
+    const char *name;
+    const char *help;
+    unsigned long size;
+    // Where the first element starts in the array
+    unsigned long offset;
+};
+static const ElementType elementTypes[] = {
+    {"f32", "4 byte floats", 4, 0},
+    {"f64", "8 byte doubles (default)", 8, 0},
+    {"v16", "16 byte pairs of doubles", 16, 0},
+    {"rec64", "64 byte records, each access touches a full cache line", 64, 0},
+    {"rec64-split", "64 byte records straddling two cache lines", 64, 32},
+};
 
-    munmap(mem, arraySize);
+// n doubles accessed together. Not aligned on purpose, rec64-split relies on
+// that.
+template <unsigned long N>
+struct Fields {
+    double v[N];
+};
 
-    return 0;
+inline double elementSum(float e) { return e; }
+inline double elementSum(double e) { return e; }
+template <unsigned long N>
+inline double elementSum(const Fields<N> &e)
+{
+    double sum = 0.0;
+    for (unsigned long i = 0; i < N; ++i)
+        sum += e.v[i];
+    return sum;
+}
+
+inline void setElement(float &e, double value) { e = value; }
+inline void setElement(double &e, double value) { e = value; }
+template <unsigned long N>
+inline void setElement(Fields<N> &e, double value)
+{
+    for (unsigned long i = 0; i < N; ++i)
+        e.v[i] = value;
+}
+
+inline void addToElement(float &e, double value) { e += value; }
+inline void addToElement(double &e, double value) { e += value; }
+template <unsigned long N>
+inline void addToElement(Fields<N> &e, double value)
+{
+    for (unsigned long i = 0; i < N; ++i)
+        e.v[i] += value;
+}
+
+// Atomically add value to *p, returning the previous value
+template <typename T>
+inline T atomicAdd(T *p, T value)
+{
+#if __cpp_lib_atomic_ref
+    return atomic_ref<T>(*p).fetch_add(value, memory_order_relaxed);
+#else
+    // Before C++20, a CAS loop is what fetch_add on a double compiles to
+    T old, desired;
+    __atomic_load(p, &old, __ATOMIC_RELAXED);
+    do {
+        desired = old + value;
+    } while (!__atomic_compare_exchange(p, &old, &desired, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return old;
+#endif
 }
+inline double atomicAddElement(float &e, double value)
+{
+    return atomicAdd(&e, float(value));
+}
+inline double atomicAddElement(double &e, double value)
+{
+    return atomicAdd(&e, value);
+}
+// Records get their first field updated, which is what a counter in an
+// object looks like
+template <unsigned long N>
+inline double atomicAddElement(Fields<N> &e, double value)
+{
+    return atomicAdd(&e.v[0], value);
+}
+
+// Tuning knobs of the access kernels
+struct KernelParams {
+    // How many indices ahead the prefetch kernel prefetches
+    unsigned long prefetchDistance = 16;
+    // Number of independent sums of the multi kernel
+    unsigned long accumulators = 4;
+};
+
+// What the kernels take: the first element, the indices and the knobs
+typedef double (*AddFn)(const void *elements, const unsigned long *begin,
+                        const unsigned long *end, const KernelParams &params);
+
+// The original loop: one sum, so every add waits for the previous one, and
+// only the out-of-order window overlaps the misses.
+template <typename T>
+double addScalar(const void *elements, const unsigned long *begin,
+                 const unsigned long *end, const KernelParams &)
+{
+    const T * const array = (const T *) elements;
+    double result = 0.0;
+    for (const unsigned long *u = begin; u != end; ++u) {
+        result += elementSum(array[*u]);
+    }
+    return result;
+}
+
+// Prefetch the element prefetchDistance accesses ahead, so misses are in
+// flight long before the add needs them. Elements crossing a cache line get
+// both lines prefetched.
+template <typename T>
+double addPrefetch(const void *elements, const unsigned long *begin,
+                   const unsigned long *end, const KernelParams &params)
+{
+    const T * const array = (const T *) elements;
+    const unsigned long distance = params.prefetchDistance;
+    double result = 0.0;
+    const unsigned long *u = begin;
+    if ((unsigned long) (end - begin) > distance) {
+        for (; u != end - distance; ++u) {
+            const char * const next = (const char *) &array[u[distance]];
+            __builtin_prefetch(next, 0, 0);
+            if (sizeof(T) > sizeof(double))
+                __builtin_prefetch(next + sizeof(T) - 1, 0, 0);
+            result += elementSum(array[*u]);
+        }
+    }
+    for (; u != end; ++u) {
+        result += elementSum(array[*u]);
+    }
+    return result;
+}
+
+// N independent sums, added up at the end.
+template <typename T, unsigned long N>
+double addMultiN(const T *array, const unsigned long *begin,
+                 const unsigned long *end)
+{
+    double sums[N] = {};
+    const unsigned long *u = begin;
+    for (; end - u >= (long) N; u += N) {
+        for (unsigned long i = 0; i < N; ++i) {
+            sums[i] += elementSum(array[u[i]]);
+        }
+    }
+    for (; u != end; ++u) {
+        sums[0] += elementSum(array[*u]);
+    }
+    double result = 0.0;
+    for (unsigned long i = 0; i < N; ++i) {
+        result += sums[i];
+    }
+    return result;
+}
+
+template <typename T>
+double addMulti(const void *elements, const unsigned long *begin,
+                const unsigned long *end, const KernelParams &params)
+{
+    const T * const array = (const T *) elements;
+    switch (params.accumulators) {
+        case 2: return addMultiN<T, 2>(array, begin, end);
+        case 4: return addMultiN<T, 4>(array, begin, end);
+        case 8: return addMultiN<T, 8>(array, begin, end);
+        default: return addMultiN<T, 16>(array, begin, end);
+    }
+}
+
+// 4 elements per vgatherqpd, two vector sums to keep two gathers in flight.
+// Doubles only.
+__attribute__((target("avx2")))
+double addGatherAvx2(const void *elements, const unsigned long *begin,
+                     const unsigned long *end, const KernelParams &)
+{
+    const double * const array = (const double *) elements;
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    const unsigned long *u = begin;
+    for (; end - u >= 8; u += 8) {
+        const __m256i idx0 = _mm256_loadu_si256((const __m256i *) u);
+        const __m256i idx1 = _mm256_loadu_si256((const __m256i *) (u + 4));
+        sum0 = _mm256_add_pd(sum0, _mm256_i64gather_pd(array, idx0, 8));
+        sum1 = _mm256_add_pd(sum1, _mm256_i64gather_pd(array, idx1, 8));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    double result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; u != end; ++u) {
+        result += array[*u];
+    }
+    return result;
+}
+
+// Same with 8 elements per gather.
+__attribute__((target("avx512f")))
+double addGatherAvx512(const void *elements, const unsigned long *begin,
+                       const unsigned long *end, const KernelParams &)
+{
+    const double * const array = (const double *) elements;
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    const unsigned long *u = begin;
+    for (; end - u >= 16; u += 16) {
+        const __m512i idx0 = _mm512_loadu_si512((const void *) u);
+        const __m512i idx1 = _mm512_loadu_si512((const void *) (u + 8));
+        // The masked form with a zeroed source keeps gcc from warning
+        // about the undefined pass-through of the plain one
+        sum0 = _mm512_add_pd(sum0, _mm512_mask_i64gather_pd(
+            _mm512_setzero_pd(), 0xff, idx0, array, 8));
+        sum1 = _mm512_add_pd(sum1, _mm512_mask_i64gather_pd(
+            _mm512_setzero_pd(), 0xff, idx1, array, 8));
+    }
+    double lanes[8];
+    _mm512_storeu_pd(lanes, _mm512_add_pd(sum0, sum1));
+    double result = 0.0;
+    for (double lane : lanes) {
+        result += lane;
+    }
+    for (; u != end; ++u) {
+        result += array[*u];
+    }
+    return result;
+}
+
+bool alwaysSupported() { return true; }
+bool avx2Supported() { return __builtin_cpu_supports("avx2"); }
+bool avx512Supported() { return __builtin_cpu_supports("avx512f"); }
+
+// Variants of the random access loop, to compare better code against bigger
+// pages on the same mapping. add has one instantiation per Element, null for
+// the types the kernel can't do.
+struct AccessKernel {
+    const char *name;
+    const char *help;
+    AddFn add[NUM_ELEMENTS];
+    bool (*supported)();
+};
+
+static const AccessKernel accessKernels[] = {
+    {"scalar", "the original loop, a single sum (default)",
+     {addScalar<float>, addScalar<double>, addScalar<Fields<2>>,
+      addScalar<Fields<8>>, addScalar<Fields<8>>}, alwaysSupported},
+    {"prefetch", "software prefetch --prefetch-distance accesses ahead",
+     {addPrefetch<float>, addPrefetch<double>, addPrefetch<Fields<2>>,
+      addPrefetch<Fields<8>>, addPrefetch<Fields<8>>}, alwaysSupported},
+    {"multi", "--accumulators independent sums",
+     {addMulti<float>, addMulti<double>, addMulti<Fields<2>>,
+      addMulti<Fields<8>>, addMulti<Fields<8>>}, alwaysSupported},
+    {"gather-avx2", "AVX2 vgatherqpd, 4 elements per gather (f64 only)",
+     {nullptr, addGatherAvx2, nullptr, nullptr, nullptr}, avx2Supported},
+    {"gather-avx512", "AVX-512 vgatherqpd, 8 elements per gather (f64 only)",
+     {nullptr, addGatherAvx512, nullptr, nullptr, nullptr}, avx512Supported},
+};
+
+const AccessKernel *findKernel(const char *name)
+{
+    for (const AccessKernel &kernel : accessKernels) {
+        if (!strcmp(kernel.name, name))
+            return &kernel;
+    }
+    return nullptr;
+}
+
+// The writing ops on array[u] for the indices in [begin, end). Writes store
+// a constant, the other ones add to the element and sum what they read so
+// the result still checks the runs did the same work.
+template <typename T>
+double updateSlice(void *elements, const unsigned long *begin,
+                   const unsigned long *end, Op op)
+{
+    T * const array = (T *) elements;
+    double result = 0.0;
+    switch (op) {
+        case OP_READ:
+            break;
+        case OP_WRITE:
+            for (const unsigned long *u = begin; u != end; ++u) {
+                setElement(array[*u], 1e-9);
+            }
+            break;
+        case OP_RMW:
+            for (const unsigned long *u = begin; u != end; ++u) {
+                result += elementSum(array[*u]);
+                addToElement(array[*u], 1e-9);
+            }
+            break;
+        case OP_ATOMIC:
+            for (const unsigned long *u = begin; u != end; ++u) {
+                result += atomicAddElement(array[*u], 1e-9);
+            }
+            break;
+    }
+    return result;
+}
+
+typedef double (*UpdateFn)(void *elements, const unsigned long *begin,
+                           const unsigned long *end, Op op);
+static const UpdateFn updateSlices[NUM_ELEMENTS] = {
+    updateSlice<float>, updateSlice<double>, updateSlice<Fields<2>>,
+    updateSlice<Fields<8>>, updateSlice<Fields<8>>,
+};
+
+// Initialize elements [begin, end)
+template <typename T>
+void initElements(void *elements, unsigned long begin, unsigned long end)
+{
+    T * const array = (T *) elements;
+    for (unsigned long i = begin; i < end; ++i) {
+        // We're going to add a lot of doubles so we generate fairly
+        // small numbers.
+        setElement(array[i], 1e-9 * double(i % 79));
+    }
+}
+
+typedef void (*InitFn)(void *elements, unsigned long begin, unsigned long end);
+static const InitFn initSlices[NUM_ELEMENTS] = {
+    initElements<float>, initElements<double>, initElements<Fields<2>>,
+    initElements<Fields<8>>, initElements<Fields<8>>,
+};
+
+// Sum array[u] for the indices in [begin, end) with kernel, or update them
+// with op if it's not a read, counting into counters
+void addSlice(void *elements, Element element, const unsigned long *begin,
+              const unsigned long *end, const AccessKernel *kernel,
+              const KernelParams *params, Op op, int cpu, atomic<int> *ready,
+              PerfCounters *counters, ThreadResult *res)
+{
+    PerfCounters local;
+    local.openLike(*counters);
+    pinAndWait(cpu, ready, res);
+
+    const AddFn add = kernel->add[element];
+    const UpdateFn update = updateSlices[element];
+    local.start();
+    res->startTime = chrono::steady_clock::now();
+    asm volatile ("" ::: "memory");
+    const double result = op == OP_READ ? add(elements, begin, end, *params)
+                                        : update(elements, begin, end, op);
+    asm volatile ("" ::: "memory");
+    res->endTime = chrono::steady_clock::now();
+    local.stop();
+    res->result = result;
+    counters->merge(local);
+}
+
+// Where the timed loop gets its indices from (--indices). The index stream
+// has its own cache and TLB footprint: 8 bytes per access stored, 4 with
+// u32, none inline.
+enum IndexMode { INDEX_STORED, INDEX_U32, INDEX_INLINE };
+
+static const char * const indexModeNames[] = {"stored", "u32", "inline"};
+
+// The scalar loop over 32-bit indices
+template <typename T>
+double addScalarU32(const void *elements, const uint32_t *begin,
+                    const uint32_t *end)
+{
+    const T * const array = (const T *) elements;
+    double result = 0.0;
+    for (const uint32_t *u = begin; u != end; ++u) {
+        result += elementSum(array[*u]);
+    }
+    return result;
+}
+
+// The scalar loop computing the uniform indices first to last in registers,
+// the same ones uniformIndex() stores so the results match. That's a few
+// multiplies per access, which don't wait for memory.
+template <typename T>
+double addScalarInline(const void *elements, uint64_t seed,
+                       unsigned long endIdx, unsigned long first,
+                       unsigned long last)
+{
+    const T * const array = (const T *) elements;
+    double result = 0.0;
+    for (unsigned long i = first; i != last; ++i) {
+        result += elementSum(array[boundedRandom(seededRandom(seed, i), endIdx)]);
+    }
+    return result;
+}
+
+typedef double (*AddU32Fn)(const void *elements, const uint32_t *begin,
+                           const uint32_t *end);
+static const AddU32Fn addU32Slices[NUM_ELEMENTS] = {
+    addScalarU32<float>, addScalarU32<double>, addScalarU32<Fields<2>>,
+    addScalarU32<Fields<8>>, addScalarU32<Fields<8>>,
+};
+
+typedef double (*AddInlineFn)(const void *elements, uint64_t seed,
+                              unsigned long endIdx, unsigned long first,
+                              unsigned long last);
+static const AddInlineFn addInlineSlices[NUM_ELEMENTS] = {
+    addScalarInline<float>, addScalarInline<double>,
+    addScalarInline<Fields<2>>, addScalarInline<Fields<8>>,
+    addScalarInline<Fields<8>>,
+};
+
+// addSlice for --indices u32 and inline: accesses first to last of the index
+// stream with the scalar kernel
+void addSliceCompact(void *elements, Element element, IndexMode mode,
+                     const Indices *indices, const PatternParams *params,
+                     unsigned long first, unsigned long last, int cpu,
+                     atomic<int> *ready, PerfCounters *counters,
+                     ThreadResult *res)
+{
+    PerfCounters local;
+    local.openLike(*counters);
+    pinAndWait(cpu, ready, res);
+
+    local.start();
+    res->startTime = chrono::steady_clock::now();
+    asm volatile ("" ::: "memory");
+    const double result = mode == INDEX_U32
+        ? addU32Slices[element](elements, indices->data32 + first,
+                                indices->data32 + last)
+        : addInlineSlices[element](elements, params->seed, params->endIdx,
+                                   first, last);
+    asm volatile ("" ::: "memory");
+    res->endTime = chrono::steady_clock::now();
+    local.stop();
+    res->result = result;
+    counters->merge(local);
+}
+
+// Run fn(begin, end) on numThreads threads, splitting [0, size) in slices
+// that are multiples of granule. Thread t is pinned to cpus[t % cpus.size()]
+// unless cpus is empty. The counts of every thread end up in counters.
+template <typename Fn>
+void runSliced(unsigned long size, unsigned long granule,
+               unsigned long numThreads, const vector<int> &cpus,
+               PerfCounters *counters, Fn fn)
+{
+    const unsigned long numGranules = (size + granule - 1) / granule;
+    vector<thread> threads;
+    counters->clear();
+    for (unsigned long t = 0; t < numThreads; ++t) {
+        const unsigned long begin = min(size, numGranules * t / numThreads * granule);
+        const unsigned long end = min(size, numGranules * (t + 1) / numThreads * granule);
+        const int cpu = cpus.empty() ? -1 : cpus[t % cpus.size()];
+        threads.emplace_back([=, &fn] {
+            PerfCounters local;
+            local.openLike(*counters);
+            pinThread(cpu);
+            local.start();
+            fn(begin, end);
+            local.stop();
+            counters->merge(local);
+        });
+    }
+    for (thread &th : threads) {
+        th.join();
+    }
+}
+
+// Elements per node of the pointer chase: one node per cache line, so every
+// step is a miss once the chain doesn't fit in the caches.
+#define CHASE_STRIDE (64 / sizeof(unsigned long))
+
+// Turn the array into a single random cycle going through every cache line.
+// links[i * CHASE_STRIDE] holds the index of the node following node i. This
+// is Sattolo's algorithm run in place: shuffling the identity that way always
+// yields a single cycle.
+void buildChase(unsigned long *links, unsigned long numNodes, uint64_t seed)
+{
+    for (unsigned long i = 0; i < numNodes; ++i) {
+        links[i * CHASE_STRIDE] = i * CHASE_STRIDE;
+    }
+    for (unsigned long i = numNodes - 1; i > 0; --i) {
+        const unsigned long j = boundedRandom(seededRandom(seed, i), i);
+        swap(links[i * CHASE_STRIDE], links[j * CHASE_STRIDE]);
+    }
+}
+
+// Follow the chain for numSteps steps starting at startIdx. Each load
+// depends on the previous one, so this measures the load-to-use latency.
+void chaseSlice(const unsigned long *links, unsigned long startIdx,
+                unsigned long numSteps, int cpu, atomic<int> *ready,
+                PerfCounters *counters, ThreadResult *res)
+{
+    PerfCounters local;
+    local.openLike(*counters);
+    pinAndWait(cpu, ready, res);
+
+    unsigned long idx = startIdx;
+    local.start();
+    res->startTime = chrono::steady_clock::now();
+    asm volatile ("" ::: "memory");
+    for (unsigned long i = 0; i < numSteps; ++i) {
+        idx = links[idx];
+    }
+    asm volatile ("" ::: "memory");
+    res->endTime = chrono::steady_clock::now();
+    local.stop();
+    res->lastIdx = idx;
+    counters->merge(local);
+}
+
+// Log-linear histogram of cycle counts, HDR style: values are exact up to
+// 2 * LATENCY_SUB_BUCKETS and then within 1/LATENCY_SUB_BUCKETS (3%) of
+// their bucket, whatever their magnitude.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1UL << LATENCY_SUB_BITS)
+struct LatencyHistogram {
+    vector<unsigned long> counts = vector<unsigned long>(64 * LATENCY_SUB_BUCKETS);
+    unsigned long total = 0;
+    unsigned long max = 0;
+
+    static unsigned long bucket(unsigned long value)
+    {
+        if (value < 2 * LATENCY_SUB_BUCKETS)
+            return value;
+        const unsigned long shift = 63 - __builtin_clzl(value) - LATENCY_SUB_BITS;
+        return 2 * LATENCY_SUB_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS
+             + (value >> shift) - LATENCY_SUB_BUCKETS;
+    }
+    // Highest value that lands in bucket b
+    static unsigned long highest(unsigned long b)
+    {
+        if (b < 2 * LATENCY_SUB_BUCKETS)
+            return b;
+        const unsigned long shift = (b - 2 * LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS + 1;
+        const unsigned long sub = b % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+    void record(unsigned long value)
+    {
+        ++counts[bucket(value)];
+        ++total;
+        max = value > max ? value : max;
+    }
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t b = 0; b < counts.size(); ++b)
+            counts[b] += other.counts[b];
+        total += other.total;
+        max = other.max > max ? other.max : max;
+    }
+    // Value under which pct percent of the samples are
+    unsigned long percentile(double pct) const
+    {
+        const unsigned long rank = ceil(pct / 100.0 * total);
+        unsigned long seen = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+            seen += counts[b];
+            if (seen >= rank && seen)
+                return min(highest(b), max);
+        }
+        return max;
+    }
+};
+
+// What the latency phase times
+struct LatencyParams {
+    // Accesses per timed sample
+    unsigned long batch = 1;
+    // Time one batch out of every
+    unsigned long every = 1;
+    // Cycles the rdtscp pair takes by itself, subtracted from every sample
+    unsigned long overhead = 0;
+};
+
+// Min cycles of back to back rdtscp, what the measurement itself costs
+unsigned long rdtscpOverhead()
+{
+    unsigned int aux;
+    unsigned long best = ~0UL;
+    for (int i = 0; i < 10000; ++i) {
+        const unsigned long t0 = __rdtscp(&aux);
+        _mm_lfence();
+        const unsigned long t1 = __rdtscp(&aux);
+        _mm_lfence();
+        best = min(best, t1 - t0);
+    }
+    return best;
+}
+
+// TSC ticks per ns, against the steady clock
+double tscPerNs()
+{
+    unsigned int aux;
+    const auto start = chrono::steady_clock::now();
+    const unsigned long t0 = __rdtscp(&aux);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    const auto end = chrono::steady_clock::now();
+    const unsigned long t1 = __rdtscp(&aux);
+    return (t1 - t0) / chrono::duration<double, nano>(end - start).count();
+}
+
+// Times batches of params->batch accesses with rdtscp, reading array[u] for
+// the indices in [begin, end), or following links for numSteps from startIdx
+// if links isn't null.
+template <typename T>
+void latencySlice(const void *elements, const unsigned long *begin,
+                  const unsigned long *end, const unsigned long *links,
+                  unsigned long startIdx, unsigned long numSteps,
+                  const LatencyParams *params, int cpu, atomic<int> *ready,
+                  ThreadResult *res, LatencyHistogram *hist)
+{
+    pinAndWait(cpu, ready, res);
+
+    const T * const array = (const T *) elements;
+    const unsigned long batch = params->batch;
+    const unsigned long every = params->every;
+    const unsigned long overhead = params->overhead;
+    unsigned int aux;
+    unsigned long t0 = 0;
+    double result = 0.0;
+    unsigned long idx = startIdx;
+    const unsigned long numBatches = links ? numSteps / batch
+                                           : (end - begin) / batch;
+    res->startTime = chrono::steady_clock::now();
+    for (unsigned long n = 0; n < numBatches; ++n) {
+        const bool timed = n % every == 0;
+        if (timed) {
+            t0 = __rdtscp(&aux);
+            _mm_lfence();
+        }
+        if (links) {
+            for (unsigned long i = 0; i < batch; ++i) {
+                idx = links[idx];
+            }
+        } else {
+            const unsigned long *u = begin + n * batch;
+            for (unsigned long i = 0; i < batch; ++i) {
+                result += elementSum(array[u[i]]);
+            }
+        }
+        if (timed) {
+            // rdtscp waits for the loads (and the adds using them) to be done
+            const unsigned long t1 = __rdtscp(&aux);
+            _mm_lfence();
+            const unsigned long cycles = t1 - t0;
+            hist->record(cycles > overhead ? cycles - overhead : 0);
+        }
+    }
+    res->endTime = chrono::steady_clock::now();
+    res->result = result;
+    res->lastIdx = idx;
+}
+
+typedef void (*LatencyFn)(const void *elements, const unsigned long *begin,
+                          const unsigned long *end, const unsigned long *links,
+                          unsigned long startIdx, unsigned long numSteps,
+                          const LatencyParams *params, int cpu,
+                          atomic<int> *ready, ThreadResult *res,
+                          LatencyHistogram *hist);
+static const LatencyFn latencySlices[NUM_ELEMENTS] = {
+    latencySlice<float>, latencySlice<double>, latencySlice<Fields<2>>,
+    latencySlice<Fields<8>>, latencySlice<Fields<8>>,
+};
+
+// The STREAM kernels, over three arrays of doubles a, b and c
+enum StreamOp {
+    STREAM_COPY,  // c = a
+    STREAM_SCALE, // b = s * c
+    STREAM_ADD,   // c = a + b
+    STREAM_TRIAD, // a = b + s * c
+    NUM_STREAM_OPS,
+};
+
+static const char * const streamOpNames[] = {"copy", "scale", "add", "triad"};
+
+// Arrays each op reads or writes, for the bytes moved. Like STREAM, the
+// reads of the lines the stores allocate aren't counted.
+static const unsigned long streamOpArrays[] = {2, 2, 3, 3};
+
+#define STREAM_SCALAR 3.0
+
+// Elements [begin, end) of op with plain loops, whatever the compiler makes of
+// them
+void streamPlain(StreamOp op, double *a, double *b, double *c,
+                 unsigned long begin, unsigned long end)
+{
+    switch (op) {
+        case STREAM_COPY:
+            for (unsigned long i = begin; i < end; ++i)
+                c[i] = a[i];
+            break;
+        case STREAM_SCALE:
+            for (unsigned long i = begin; i < end; ++i)
+                b[i] = STREAM_SCALAR * c[i];
+            break;
+        case STREAM_ADD:
+            for (unsigned long i = begin; i < end; ++i)
+                c[i] = a[i] + b[i];
+            break;
+        case STREAM_TRIAD:
+            for (unsigned long i = begin; i < end; ++i)
+                a[i] = b[i] + STREAM_SCALAR * c[i];
+            break;
+        default:
+            break;
+    }
+}
+
+// SSE2 with movntpd stores, which don't read the lines they write first.
+// begin and end are multiples of 8.
+void streamNt(StreamOp op, double *a, double *b, double *c,
+              unsigned long begin, unsigned long end)
+{
+    const __m128d s = _mm_set1_pd(STREAM_SCALAR);
+    switch (op) {
+        case STREAM_COPY:
+            for (unsigned long i = begin; i < end; i += 2)
+                _mm_stream_pd(c + i, _mm_load_pd(a + i));
+            break;
+        case STREAM_SCALE:
+            for (unsigned long i = begin; i < end; i += 2)
+                _mm_stream_pd(b + i, _mm_mul_pd(s, _mm_load_pd(c + i)));
+            break;
+        case STREAM_ADD:
+            for (unsigned long i = begin; i < end; i += 2)
+                _mm_stream_pd(c + i, _mm_add_pd(_mm_load_pd(a + i),
+                                                _mm_load_pd(b + i)));
+            break;
+        case STREAM_TRIAD:
+            for (unsigned long i = begin; i < end; i += 2)
+                _mm_stream_pd(a + i, _mm_add_pd(_mm_load_pd(b + i),
+                    _mm_mul_pd(s, _mm_load_pd(c + i))));
+            break;
+        default:
+            break;
+    }
+    // Streaming stores are weakly ordered, make them visible before the
+    // phase ends
+    _mm_sfence();
+}
+
+template <bool NT>
+__attribute__((target("avx512f")))
+inline void store512(double *p, __m512d v)
+{
+    if (NT)
+        _mm512_stream_pd(p, v);
+    else
+        _mm512_store_pd(p, v);
+}
+
+// A full cache line per load and store, with or without vmovntpd
+template <bool NT>
+__attribute__((target("avx512f")))
+void streamAvx512(StreamOp op, double *a, double *b, double *c,
+                  unsigned long begin, unsigned long end)
+{
+    const __m512d s = _mm512_set1_pd(STREAM_SCALAR);
+    switch (op) {
+        case STREAM_COPY:
+            for (unsigned long i = begin; i < end; i += 8)
+                store512<NT>(c + i, _mm512_load_pd(a + i));
+            break;
+        case STREAM_SCALE:
+            for (unsigned long i = begin; i < end; i += 8)
+                store512<NT>(b + i, _mm512_mul_pd(s, _mm512_load_pd(c + i)));
+            break;
+        case STREAM_ADD:
+            for (unsigned long i = begin; i < end; i += 8)
+                store512<NT>(c + i, _mm512_add_pd(_mm512_load_pd(a + i),
+                                                  _mm512_load_pd(b + i)));
+            break;
+        case STREAM_TRIAD:
+            for (unsigned long i = begin; i < end; i += 8)
+                store512<NT>(a + i, _mm512_add_pd(_mm512_load_pd(b + i),
+                    _mm512_mul_pd(s, _mm512_load_pd(c + i))));
+            break;
+        default:
+            break;
+    }
+    if (NT)
+        _mm_sfence();
+}
+
+typedef void (*StreamFn)(StreamOp op, double *a, double *b, double *c,
+                         unsigned long begin, unsigned long end);
+
+// Variants of the STREAM loops (--stream)
+struct StreamVariant {
+    const char *name;
+    const char *help;
+    StreamFn fn;
+    bool (*supported)();
+};
+
+static const StreamVariant streamVariants[] = {
+    {"plain", "the C loops, regular stores", streamPlain, alwaysSupported},
+    {"nt", "SSE2 with non-temporal stores", streamNt, alwaysSupported},
+    {"avx512", "AVX-512, regular stores", streamAvx512<false>, avx512Supported},
+    {"avx512-nt", "AVX-512 with non-temporal stores", streamAvx512<true>,
+     avx512Supported},
+};
+
+const StreamVariant *findStreamVariant(const char *name)
+{
+    for (const StreamVariant &variant : streamVariants) {
+        if (!strcmp(variant.name, name))
+            return &variant;
+    }
+    return nullptr;
+}
+
+// One thread of a STREAM phase
+void streamSlice(const StreamVariant *variant, StreamOp op, double *a,
+                 double *b, double *c, unsigned long begin, unsigned long end,
+                 int cpu, atomic<int> *ready, PerfCounters *counters,
+                 ThreadResult *res)
+{
+    PerfCounters local;
+    local.openLike(*counters);
+    pinAndWait(cpu, ready, res);
+
+    local.start();
+    res->startTime = chrono::steady_clock::now();
+    asm volatile ("" ::: "memory");
+    variant->fn(op, a, b, c, begin, end);
+    asm volatile ("" ::: "memory");
+    res->endTime = chrono::steady_clock::now();
+    local.stop();
+    counters->merge(local);
+}
+
+void usage(char *name) {
+    printf("Usage: %s [options]\n", name);
+    puts("Options");
+    puts(" -h: display usage");
+    puts(" -j threads: number of threads doing the random accesses, default 1."
+         " Threads are pinned to distinct CPUs");
+    puts(" -m: madvise the memory with MADV_HUGEPAGE (THP), conflicts with -t");
+    puts(" -s size: array size in GiB, or with a k, m or g suffix (e.g. "
+         "512m), default is 32Gib, max 128Gib");
+    puts(" -t: allocate the array with MAP_HUGETLB (hugetlbfs), conflicts "
+         "with -m");
+    puts(" --page-size {4k,2m,1g}: page size of the array. 2m uses THP with -m "
+         "and hugetlbfs otherwise, 1g always uses hugetlbfs. -t alone "
+         "means 2m");
+    puts(" --backing {anon,shm,file:PATH,hugetlbfs:PATH}: map the array "
+         "anonymous (default), from a memfd (with MFD_HUGETLB with -t), from "
+         "the new file or the DAX device PATH, or from a new file in the hugetlbfs "
+         "mount PATH");
+    puts(" --cpu-node nodes: only run the threads on the CPUs of these NUMA "
+         "nodes (e.g. 0 or 0,1)");
+    puts(" --mem-node nodes: bind the array to these NUMA nodes, interleaved "
+         "if more than one");
+    puts(" --pattern pattern: access pattern, one of");
+    for (const AccessPattern &pattern : accessPatterns) {
+        printf("     %s: %s\n", pattern.name, pattern.help);
+    }
+    puts(" --stride bytes: distance between accesses of the stride pattern, "
+         "default 4096");
+    puts(" --zipf-skew skew: skew of the zipf pattern, default 0.99");
+    puts(" --hot-set sizeInMib: working set of the hotset pattern, default 64");
+    puts(" --perf: count cycles, instructions, dTLB and LLC load misses, "
+         "page faults and page walk cycles during each phase");
+    puts(" --perf-walk-event config: raw perf config of the page walk cycles "
+         "event, default DTLB_LOAD_MISSES.WALK_ACTIVE on Intel");
+    puts(" --prefault mode: fault the array in before initializing it, and "
+         "time both separately. mode is one of");
+    puts("     none: the initialization takes the page faults (default)");
+    puts("     populate: mmap with MAP_POPULATE, conflicts with -m and "
+         "--mem-node");
+    puts("     madvise: madvise(MADV_POPULATE_WRITE), Linux 5.14+");
+    puts("     touch: write one byte per page");
+    puts(" --parallel-init: prefault and initialize the array with the -j "
+         "threads, on their CPUs (first touch NUMA placement)");
+    puts(" --seed seed: generate the indices in memory from this seed instead "
+         "of using " CACHED_INDICES_FILE);
+    puts(" --pagemap: also check every page of the array in "
+         "/proc/self/pagemap and /proc/kpageflags (root only) after the "
+         "initialization");
+    puts(" --min-coverage percent: with huge pages, flag the results as "
+         "invalid if less than that much of the array is backed by huge "
+         "pages, default 90");
+    puts(" --kernel kernels: comma separated access kernels to run one after "
+         "the other on the same array, or all. Kernels are");
+    for (const AccessKernel &kernel : accessKernels) {
+        printf("     %s: %s\n", kernel.name, kernel.help);
+    }
+    puts(" --prefetch-distance accesses: look-ahead of the prefetch kernel, "
+         "default 16");
+    puts(" --accumulators {2,4,8,16}: sums of the multi kernel, default 4");
+    puts(" --element type: type of the array elements, the indices pick "
+         "elements of that size. Types are");
+    for (const ElementType &type : elementTypes) {
+        printf("     %s: %s\n", type.name, type.help);
+    }
+    puts(" --op {read,write,rmw,atomic}: what each access does, sum the "
+         "element (default), store to it, add to it, or add to it with an "
+         "atomic fetch_add. Only the scalar kernel writes");
+    puts(" --indices {stored,u32,inline}: how the scalar loop gets its "
+         "indices, a list of 64-bit indices (default), of 32-bit ones, or "
+         "uniform ones computed in the loop without touching memory");
+    puts(" --latency: after the timed phase, time the same accesses with "
+         "rdtscp and print latency percentiles");
+    puts(" --latency-batch accesses: accesses per timed sample, default 1");
+    puts(" --latency-every batches: only time one batch out of that many, "
+         "default 1");
+    puts(" --antagonists threads: that many threads fragmenting memory with "
+         "4kB pages during each run");
+    puts(" --antagonist-mib MiB: memory each antagonist holds at most, "
+         "default 1024");
+    puts(" --compact-every ms: write /proc/sys/vm/compact_memory that often "
+         "during each run (root only)");
+    puts(" --sweep: run the access phase over growing parts of the array, "
+         "from 32kB doubling up to -s, and print ns per access for each");
+    puts(" --stream variants: after the access phase, run the STREAM copy, "
+         "scale, add and triad kernels over the array with the -j threads "
+         "and print GB/s, for these comma separated variants, or all. "
+         "Variants are");
+    for (const StreamVariant &variant : streamVariants) {
+        printf("     %s: %s\n", variant.name, variant.help);
+    }
+    puts(" --processes readers: fork that many processes running the access "
+         "phase at the same time on the array, and print their fork time, "
+         "access time and page tables (VmPTE). Use --backing shm or "
+         "hugetlbfs to share the array, anon shares it copy on write");
+    puts(" --collapse {madvise,khugepaged}: fault the array in with 4kB "
+         "pages, then get THP in rounds, with MADV_COLLAPSE (Linux 6.1+) on "
+         "part of the array each round or by waiting for khugepaged, and run "
+         "the access phase after each round");
+    puts(" --collapse-rounds rounds: rounds of --collapse, default 4");
+    puts(" --collapse-interval ms: wait of each khugepaged round, default 1000");
+    puts(" --repeat runs: map, initialize and access the array that many "
+         "times and report min/median/p99 per phase, default 1");
+    puts(" --format {text,json,csv}: print the results as text (default), "
+         "JSON or CSV on stdout. Progress goes to stderr with json and csv");
+    exit(1);
+}
+
+enum LongOptions {
+    OPT_CPU_NODE = 256,
+    OPT_MEM_NODE,
+    OPT_SEED,
+    OPT_PATTERN,
+    OPT_STRIDE,
+    OPT_ZIPF_SKEW,
+    OPT_HOT_SET,
+    OPT_PAGE_SIZE,
+    OPT_PERF,
+    OPT_PERF_WALK_EVENT,
+    OPT_PREFAULT,
+    OPT_PARALLEL_INIT,
+    OPT_REPEAT,
+    OPT_FORMAT,
+    OPT_PAGEMAP,
+    OPT_MIN_COVERAGE,
+    OPT_KERNEL,
+    OPT_PREFETCH_DISTANCE,
+    OPT_ACCUMULATORS,
+    OPT_OP,
+    OPT_BACKING,
+    OPT_LATENCY,
+    OPT_LATENCY_BATCH,
+    OPT_LATENCY_EVERY,
+    OPT_ANTAGONISTS,
+    OPT_ANTAGONIST_MIB,
+    OPT_COMPACT_EVERY,
+    OPT_ELEMENT,
+    OPT_SWEEP,
+    OPT_INDICES,
+    OPT_COLLAPSE,
+    OPT_STREAM,
+    OPT_PROCESSES,
+    OPT_COLLAPSE_ROUNDS,
+    OPT_COLLAPSE_INTERVAL,
+};
+
+enum Prefault {
+    PREFAULT_NONE,
+    PREFAULT_POPULATE,
+    PREFAULT_MADVISE,
+    PREFAULT_TOUCH,
+};
+
+static const char * const prefaultNames[] = {
+    "none", "populate", "madvise", "touch",
+};
+
+enum Collapse {
+    COLLAPSE_NONE,
+    COLLAPSE_MADVISE,
+    COLLAPSE_KHUGEPAGED,
+};
+
+static const char * const collapseNames[] = {
+    "none", "madvise", "khugepaged",
+};
+
+// Where the pages of the array come from
+enum Backing {
+    BACKING_ANON,
+    BACKING_SHM,
+    BACKING_FILE,
+    BACKING_HUGETLBFS,
+};
+static const char * const backingNames[] = {
+    "anon", "shm", "file", "hugetlbfs",
+};
+
+enum Format {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV,
+};
+
+// Everything the command line configures
+struct Config {
+    // Default size of the array: 32GiB, i.e 4Gi doubles
+    unsigned long arraySize = 32U*1024UL*1024UL*1024UL;
+    // One past last valid index in the array.
+    unsigned long endIdx = arraySize / sizeof(double);
+    Element element = ELEMENT_F64;
+
+    bool hugetlb = false, thp = false;
+    // Page size of the array in KiB, 0 until picked
+    unsigned long pageSizeKib = 0;
+    // Derived from the above: the mapping is a whole number of pages
+    unsigned long pageBytes = 0, numPages = 0, mapSize = 0;
+
+    bool perf = false;
+    uint64_t walkEvent = 0;
+    Prefault prefault = PREFAULT_NONE;
+    Backing backing = BACKING_ANON;
+    // File of file:, directory of hugetlbfs:
+    string backingPath;
+    bool parallelInit = false;
+
+    // Threads doing the random accesses, and whether to pin them
+    unsigned long numThreads = 1;
+    bool pin = false;
+    vector<int> cpuNodes, memNodes;
+    // CPUs the threads get pinned to if pin
+    vector<int> cpus;
+
+    // Generate the indices in memory from seed instead of using the file
+    bool seeded = false;
+    uint64_t seed = 0;
+    const AccessPattern *pattern = findPattern("uniform");
+    // Patterns without an index function work in the array itself
+    bool chase = false;
+    unsigned long strideBytes = 4096, hotSetMib = 64;
+    double zipfSkew = 0.99;
+    PatternParams params;
+    // Number of accesses into the array we'll bench
+    unsigned long numIndices = 0;
+    // Access kernels to run, in order, on the same mapping
+    vector<const AccessKernel *> kernels;
+    // --stream, none by default
+    vector<const StreamVariant *> streamVariants;
+    bool allStreamVariants = false;
+    // --kernel all: skip the ones that can't run instead of failing
+    bool allKernels = false;
+    KernelParams kernelParams;
+    Op op = OP_READ;
+    IndexMode indexMode = INDEX_STORED;
+    bool latencyMode = false;
+    LatencyParams latency;
+    // Access phase over growing prefixes of the array instead of all of it
+    bool sweep = false;
+    // Start on 4kB pages and get huge pages in rounds
+    Collapse collapse = COLLAPSE_NONE;
+    unsigned long collapseRounds = 4, collapseIntervalMs = 1000;
+    // Reader processes running the access phase (--processes)
+    unsigned long processes = 0;
+    double tscPerNs = 0.0;
+    // Background memory pressure
+    unsigned long antagonists = 0;
+    unsigned long antagonistMib = 1024;
+    unsigned long compactEveryMs = 0;
+
+    // Check the huge page coverage with pagemap too, and threshold under
+    // which the results are invalid
+    bool pagemap = false;
+    double minCoverage = 90.0;
+
+    unsigned long repeat = 1;
+    Format format = FORMAT_TEXT;
+};
+
+// Measurements of one phase of one run: the elapsed time ("secs") and the
+// counters that could be read, or anything else measured after a phase
+struct PhaseResult {
+    string name;
+    vector<pair<string, double>> metrics;
+};
+
+// Measurements of one run, phases in the order they ran
+struct RunResult {
+    vector<PhaseResult> phases;
+    double result = 0.0;
+    unsigned long lastIdx = 0;
+    // False if the huge page coverage was below --min-coverage
+    bool valid = true;
+
+    void add(const char *name, double secs, const PerfCounters &counters)
+    {
+        PhaseResult phase;
+        phase.name = name;
+        phase.metrics.emplace_back("secs", secs);
+        for (const PerfCounters::Counter &counter : counters.counters) {
+            if (counter.fd >= 0)
+                phase.metrics.emplace_back(counter.name, counter.value);
+        }
+        phases.push_back(phase);
+    }
+};
+
+// Report how much of the array is backed by each page size, in run as the
+// "Residency" phase, and flag the run if there are too few huge pages.
+void checkResidency(const Config &config, const void *mem, RunResult *run)
+{
+    Residency res;
+    if (!readSmaps(mem, config.mapSize, &res)) {
+        return;
+    }
+    const double sizeKib = config.mapSize / 1024.0;
+    double thpPct = 100.0 * res.thpKib / sizeKib;
+    double hugetlbPct = 100.0 * res.hugetlbKib / sizeKib;
+    const double smallPct = 100.0 * (res.rssKib - res.thpKib) / sizeKib;
+    printf("Array residency%s: 4kB pages %.1lf%%, THP %.1lf%%, hugetlbfs "
+           "%.1lf%%\n", res.exact ? "" : " (estimated, mapping merged with a "
+           "neighbour)", smallPct, thpPct, hugetlbPct);
+
+    PhaseResult phase;
+    phase.name = "Residency";
+    phase.metrics.emplace_back("4k_pct", smallPct);
+    phase.metrics.emplace_back("thp_pct", thpPct);
+    phase.metrics.emplace_back("hugetlb_pct", hugetlbPct);
+
+    // The pagemap is per page, so it's the one to trust with estimates
+    PageMapCounts counts;
+    bool exact = res.exact;
+    if ((config.pagemap || !exact) && readPageMap(mem, config.mapSize, &counts)) {
+        const double presentPct = 100.0 * counts.present / counts.pages;
+        printf("Pagemap: %.1lf%% of the pages present", presentPct);
+        phase.metrics.emplace_back("pagemap_present_pct", presentPct);
+        if (counts.withPfn) {
+            const double pfnThpPct = 100.0 * counts.thp / counts.pages;
+            const double pfnHugetlbPct = 100.0 * counts.hugetlb / counts.pages;
+            printf(", THP %.1lf%%, hugetlbfs %.1lf%%\n", pfnThpPct,
+                   pfnHugetlbPct);
+            phase.metrics.emplace_back("pagemap_thp_pct", pfnThpPct);
+            phase.metrics.emplace_back("pagemap_hugetlb_pct", pfnHugetlbPct);
+            if (!exact) {
+                thpPct = pfnThpPct;
+                hugetlbPct = pfnHugetlbPct;
+                exact = true;
+            }
+        } else {
+            puts(" (no PFNs, run as root to get the page kinds)");
+        }
+    }
+    run->phases.push_back(phase);
+
+    // Fragmentation can silently leave part of a THP array on 4k pages
+    const double hugePct = thpPct + hugetlbPct;
+    if ((config.thp || config.hugetlb) && hugePct < config.minCoverage && !exact) {
+        printf("WARNING: about %.1lf%% of the array is backed by huge pages "
+               "(--min-coverage %.1lf), run as root to check\n", hugePct,
+               config.minCoverage);
+    } else if ((config.thp || config.hugetlb) && hugePct < config.minCoverage) {
+        printf("WARNING: only %.1lf%% of the array is backed by huge pages "
+               "(--min-coverage %.1lf), results are INVALID\n", hugePct,
+               config.minCoverage);
+        run->valid = false;
+    }
+}
+
+// The timed phase: accesses into the array with kernel, or following the
+// chain if kernel is null.
+void accessPhase(const Config &config, const Indices &indices, void *mem,
+                 const AccessKernel *kernel, PerfCounters &counters,
+                 RunResult *run, const string &suffix = "")
+{
+    const unsigned long numThreads = config.numThreads;
+    const unsigned long numIndices = config.numIndices;
+    const bool chase = config.chase;
+    const vector<int> &cpus = config.cpus;
+    void * const elements = (char *) mem + elementTypes[config.element].offset;
+    const unsigned long * const links = (const unsigned long *) mem;
+    const unsigned long numNodes = config.arraySize / (CHASE_STRIDE * sizeof(unsigned long));
+    chrono::time_point<chrono::steady_clock> startTime, endTime;
+    chrono::duration<double> elapsed;
+
+    static const char * const opPhases[] = {
+        "Adding", "Writing", "Updating", "Atomic updating",
+    };
+    double result = 0.0;
+    unsigned long lastIdx = 0;
+    // The original loop keeps its name
+    string phase = chase ? "Chasing" : opPhases[config.op];
+    if (kernel && kernel != &accessKernels[0])
+        phase = phase + "/" + kernel->name;
+    phase += suffix;
+
+    // What we're really timing: randomly generated accesses into the double
+    // array.  We're computing result to make sure all runs are consistent but
+    // also so the compiler does not get too clever and removes the code
+    // we're trying to measure.
+    // Each thread gets a contiguous slice of the indices. The aggregate time
+    // goes from the first thread starting to the last one finishing.
+    // When chasing, each thread walks its share of the steps starting from
+    // its own node of the same cycle.
+    vector<ThreadResult> threadResults(numThreads);
+    vector<thread> threads;
+    atomic<int> ready(numThreads);
+    counters.clear();
+    for (unsigned long t = 0; t < numThreads; ++t) {
+        const unsigned long first = numIndices * t / numThreads;
+        const unsigned long last = numIndices * (t + 1) / numThreads;
+        const int cpu = config.pin ? cpus[t % cpus.size()] : -1;
+        if (chase) {
+            const unsigned long startIdx = numNodes * t / numThreads * CHASE_STRIDE;
+            threads.emplace_back(chaseSlice, links, startIdx, last - first, cpu,
+                                 &ready, &counters, &threadResults[t]);
+        } else if (config.indexMode != INDEX_STORED) {
+            threads.emplace_back(addSliceCompact, elements, config.element,
+                                 config.indexMode, &indices, &config.params,
+                                 first, last, cpu, &ready, &counters,
+                                 &threadResults[t]);
+        } else {
+            threads.emplace_back(addSlice, elements, config.element,
+                                 indices.data + first, indices.data + last,
+                                 kernel, &config.kernelParams, config.op, cpu,
+                                 &ready, &counters, &threadResults[t]);
+        }
+    }
+    for (thread &th : threads) {
+        th.join();
+    }
+
+    startTime = threadResults[0].startTime;
+    endTime = threadResults[0].endTime;
+    for (unsigned long t = 0; t < numThreads; ++t) {
+        const ThreadResult &res = threadResults[t];
+        startTime = min(startTime, res.startTime);
+        endTime = max(endTime, res.endTime);
+        result += res.result;
+        lastIdx ^= res.lastIdx;
+        if (numThreads > 1) {
+            elapsed = res.endTime - res.startTime;
+            printf("Thread %lu (CPU %d): %s took %.4lf secs\n", t, res.cpu,
+                   phase.c_str(), elapsed.count());
+        }
+    }
+
+    elapsed = endTime - startTime;
+
+    if (chase) {
+        // Every thread does its steps concurrently, the latency is per thread
+        const double steps = double(numIndices) / numThreads;
+        printf("%s took %.4lf secs (%.2lf ns per access)\n", phase.c_str(),
+               elapsed.count(), elapsed.count() * 1e9 / steps);
+        // Same seed, same size and same number of threads: same result.
+        printf("Result is %lu\n", lastIdx);
+    } else {
+        printf("%s took %.4lf secs\n", phase.c_str(), elapsed.count());
+        // The result is interesting just to double check that every run is
+        // adding the same doubles.
+        printf("Result is %lf\n", result);
+    }
+    counters.print(phase.c_str(), numIndices);
+    run->add(phase.c_str(), elapsed.count(), counters);
+    run->result = result;
+    run->lastIdx = lastIdx;
+}
+
+// Smallest part of the array --sweep accesses: within the L1 dTLB reach
+// with any page size
+#define SWEEP_MIN_BYTES (32UL * 1024)
+
+// --sweep: the access phase over the first 32kB of the array, then 64kB...
+// doubling up to the whole array, with the same number of accesses each
+// time. Every size gets its own indices (or chain) within that part, so the
+// ns per access show when the working set stops fitting in the TLBs and
+// caches. The phases are named like "Adding@64k".
+bool sweepPhases(const Config &config, void *mem, PerfCounters &counters,
+                 RunResult *run)
+{
+    const ElementType &elementType = elementTypes[config.element];
+    const unsigned long genThreads = max(1U, thread::hardware_concurrency());
+    vector<unsigned long> sizes;
+    for (unsigned long size = SWEEP_MIN_BYTES; size < config.arraySize; size *= 2)
+        sizes.push_back(size);
+    sizes.push_back(config.arraySize);
+
+    vector<pair<string, double>> curve;
+    for (unsigned long size : sizes) {
+        Config part = config;
+        part.arraySize = size;
+        part.endIdx = max(1UL, (size - elementType.offset) / elementType.size);
+        const string suffix = "@" + sizeString(size);
+        Indices indices;
+        if (config.chase) {
+            // Not timed, the chain of the previous size gets overwritten
+            buildChase((unsigned long *) mem,
+                       max(1UL, size / (CHASE_STRIDE * sizeof(unsigned long))),
+                       config.seed);
+        } else {
+            PatternParams &params = part.params;
+            params.endIdx = part.endIdx;
+            params.zipfScatter = coprimeScatter(part.endIdx);
+            params.hotSetIdx = min(part.endIdx,
+                                   config.hotSetMib * 1024 * 1024 / elementType.size);
+            if (config.indexMode != INDEX_INLINE
+             && !generateSeededIndices(&indices, *config.pattern, params,
+                                       part.numIndices, genThreads,
+                                       config.indexMode == INDEX_U32)) {
+                puts("Can't get indices");
+                return false;
+            }
+        }
+        printf("Sweeping %s\n", sizeString(size).c_str());
+        const vector<const AccessKernel *> kernels = config.chase
+            ? vector<const AccessKernel *>(1, nullptr) : config.kernels;
+        for (const AccessKernel *kernel : kernels) {
+            accessPhase(part, indices, mem, kernel, counters, run, suffix);
+            // Per thread, like the chase latency
+            PhaseResult &phase = run->phases.back();
+            const double ns = phase.metrics[0].second * 1e9
+                            / (double(part.numIndices) / part.numThreads);
+            phase.metrics.emplace_back("ns_per_access", ns);
+            curve.emplace_back(phase.name, ns);
+        }
+    }
+
+    puts("Sweep, ns per access:");
+    for (const auto &point : curve)
+        printf("%s %.2lf\n", point.first.c_str(), point.second);
+    return true;
+}
+
+// Size of the block or character (DAX) device open as fd, 0 if unknown
+unsigned long deviceSize(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t bytes;
+        return ioctl(fd, BLKGETSIZE64, &bytes) ? 0 : bytes;
+    }
+    if (!S_ISCHR(st.st_mode))
+        return 0;
+    char sysPath[64];
+    snprintf(sysPath, sizeof(sysPath), "/sys/dev/char/%u:%u/size",
+             major(st.st_rdev), minor(st.st_rdev));
+    ifstream ifs(sysPath);
+    unsigned long bytes = 0;
+    ifs >> bytes;
+    return bytes;
+}
+
+// Gets a file descriptor of mapSize bytes for the shared backings, so every
+// run starts from fresh pages. Files we create are unlinked right away and go
+// away with the mapping.
+bool openBacking(const Config &config, int *fd)
+{
+    const char * const path = config.backingPath.c_str();
+    switch (config.backing) {
+        case BACKING_ANON:
+            *fd = -1;
+            return true;
+        case BACKING_SHM: {
+            unsigned int flags = MFD_CLOEXEC;
+            if (config.hugetlb)
+                flags |= MFD_HUGETLB
+                       | (config.pageSizeKib == 2048 ? MFD_HUGE_2MB
+                                                     : MFD_HUGE_1GB);
+            *fd = memfd_create("huge_memory_bench", flags);
+            if (*fd < 0) {
+                perror("memfd_create");
+                return false;
+            }
+            break;
+        }
+        case BACKING_FILE: {
+            *fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (*fd >= 0) {
+                unlink(path);
+                break;
+            }
+            // Never resize someone's file, only use devices as they are
+            struct stat st;
+            if (errno != EEXIST || stat(path, &st) || S_ISREG(st.st_mode)) {
+                printf("Can't create %s: %s\n", path,
+                       errno == EEXIST || !errno ? "it already exists"
+                                                 : strerror(errno));
+                return false;
+            }
+            *fd = open(path, O_RDWR | O_CLOEXEC);
+            if (*fd < 0) {
+                printf("Can't open %s: %s\n", path, strerror(errno));
+                return false;
+            }
+            const unsigned long size = deviceSize(*fd);
+            if (size < config.mapSize) {
+                printf("%s is %lu bytes, the array needs %lu\n", path, size,
+                       config.mapSize);
+                close(*fd);
+                return false;
+            }
+            return true;
+        }
+        case BACKING_HUGETLBFS: {
+            string name = config.backingPath + "/huge_memory_bench.XXXXXX";
+            *fd = mkstemp(&name[0]);
+            if (*fd < 0) {
+                printf("Can't create a file in %s: %s\n", path,
+                       strerror(errno));
+                return false;
+            }
+            unlink(name.c_str());
+            break;
+        }
+    }
+    if (ftruncate(*fd, config.mapSize)) {
+        perror("ftruncate");
+        close(*fd);
+        return false;
+    }
+    return true;
+}
+
+// Per access latency of the same accesses as the timed phase, sampled with
+// rdtscp into a histogram. Always reads, whatever --op is.
+void latencyPhase(const Config &config, const Indices &indices, void *mem,
+                  RunResult *run)
+{
+    const unsigned long numThreads = config.numThreads;
+    const unsigned long numIndices = config.numIndices;
+    const vector<int> &cpus = config.cpus;
+    const void * const elements = (const char *) mem
+                                + elementTypes[config.element].offset;
+    const unsigned long * const links = (const unsigned long *) mem;
+    const unsigned long numNodes = config.arraySize / (CHASE_STRIDE * sizeof(unsigned long));
+
+    vector<ThreadResult> threadResults(numThreads);
+    vector<LatencyHistogram> histograms(numThreads);
+    vector<thread> threads;
+    atomic<int> ready(numThreads);
+    for (unsigned long t = 0; t < numThreads; ++t) {
+        const unsigned long first = numIndices * t / numThreads;
+        const unsigned long last = numIndices * (t + 1) / numThreads;
+        const int cpu = config.pin ? cpus[t % cpus.size()] : -1;
+        const unsigned long startIdx = numNodes * t / numThreads * CHASE_STRIDE;
+        threads.emplace_back(latencySlices[config.element], elements,
+                             indices.data + first,
+                             indices.data + last,
+                             config.chase ? links : nullptr, startIdx,
+                             last - first, &config.latency, cpu, &ready,
+                             &threadResults[t], &histograms[t]);
+    }
+    for (thread &th : threads) {
+        th.join();
+    }
+    LatencyHistogram hist;
+    for (const LatencyHistogram &h : histograms) {
+        hist.merge(h);
+    }
+    if (!hist.total) {
+        puts("No latency samples, the array is too small for --latency-batch");
+        return;
+    }
+
+    const double nsPerTick = 1.0 / config.tscPerNs;
+    const double p50 = hist.percentile(50) * nsPerTick;
+    const double p99 = hist.percentile(99) * nsPerTick;
+    const double p999 = hist.percentile(99.9) * nsPerTick;
+    const double max = hist.max * nsPerTick;
+    if (config.latency.batch > 1)
+        printf("Latency of batches of %lu accesses", config.latency.batch);
+    else
+        printf("Latency of single accesses");
+    printf(" over %lu samples: p50 %.1lf ns, p99 %.1lf ns, p99.9 %.1lf ns, "
+           "max %.1lf ns\n", hist.total, p50, p99, p999, max);
+
+    PhaseResult phase;
+    phase.name = "Latency";
+    phase.metrics.emplace_back("p50_ns", p50);
+    phase.metrics.emplace_back("p99_ns", p99);
+    phase.metrics.emplace_back("p999_ns", p999);
+    phase.metrics.emplace_back("max_ns", max);
+    phase.metrics.emplace_back("samples", hist.total);
+    run->phases.push_back(phase);
+}
+
+// Elements of the slices of the STREAM threads, a 4kB page of doubles
+#define STREAM_GRANULE 512UL
+
+// --stream: the STREAM kernels on the -j threads, over the array split in
+// three arrays of doubles. Runs last since it overwrites the array. Each
+// "Stream op/variant" phase has its GB/s, per page kind since that's what
+// differs between runs.
+void streamPhases(const Config &config, void *mem, hugepages::PageKind kind,
+                  PerfCounters &counters, RunResult *run)
+{
+    const unsigned long numThreads = config.numThreads;
+    const vector<int> &cpus = config.cpus;
+    const unsigned long n = config.arraySize / sizeof(double) / 3
+                          / STREAM_GRANULE * STREAM_GRANULE;
+    if (!n) {
+        puts("The array is too small for --stream");
+        return;
+    }
+    double * const a = (double *) mem;
+    double * const b = a + n;
+    double * const c = b + n;
+    // Not timed. What the access phases left there could be denormals.
+    runSliced(n, STREAM_GRANULE, numThreads, config.pin ? cpus : vector<int>(),
+              &counters, [=](unsigned long begin, unsigned long end) {
+        for (unsigned long i = begin; i < end; ++i) {
+            a[i] = 1.0;
+            b[i] = 2.0;
+            c[i] = 0.0;
+        }
+    });
+
+    const unsigned long numGranules = n / STREAM_GRANULE;
+    vector<vector<double>> table;
+    for (const StreamVariant *variant : config.streamVariants) {
+        table.emplace_back();
+        for (int op = 0; op < NUM_STREAM_OPS; ++op) {
+            const string phase = string("Stream ") + streamOpNames[op] + "/"
+                               + variant->name;
+            vector<ThreadResult> threadResults(numThreads);
+            vector<thread> threads;
+            atomic<int> ready(numThreads);
+            counters.clear();
+            for (unsigned long t = 0; t < numThreads; ++t) {
+                const unsigned long begin = numGranules * t / numThreads * STREAM_GRANULE;
+                const unsigned long end = numGranules * (t + 1) / numThreads * STREAM_GRANULE;
+                const int cpu = config.pin ? cpus[t % cpus.size()] : -1;
+                threads.emplace_back(streamSlice, variant, StreamOp(op), a, b,
+                                     c, begin, end, cpu, &ready, &counters,
+                                     &threadResults[t]);
+            }
+            for (thread &th : threads) {
+                th.join();
+            }
+            auto startTime = threadResults[0].startTime;
+            auto endTime = threadResults[0].endTime;
+            for (const ThreadResult &res : threadResults) {
+                startTime = min(startTime, res.startTime);
+                endTime = max(endTime, res.endTime);
+            }
+            const chrono::duration<double> elapsed = endTime - startTime;
+            const double bytes = double(streamOpArrays[op]) * n * sizeof(double);
+            const double gbPerSec = bytes / elapsed.count() / 1e9;
+            printf("%s took %.4lf secs (%.2lf GB/s)\n", phase.c_str(),
+                   elapsed.count(), gbPerSec);
+            counters.print(phase.c_str(), n);
+            run->add(phase.c_str(), elapsed.count(), counters);
+            run->phases.back().metrics.emplace_back("gb_per_s", gbPerSec);
+            table.back().push_back(gbPerSec);
+        }
+    }
+
+    printf("Stream, GB/s with %s pages, %lu thread%s, %s per array:\n",
+           hugepages::pageKindNames[kind], numThreads,
+           numThreads == 1 ? "" : "s", sizeString(n * sizeof(double)).c_str());
+    printf("%-10s", "");
+    for (const char *name : streamOpNames)
+        printf(" %8s", name);
+    printf("\n");
+    for (size_t v = 0; v < table.size(); ++v) {
+        printf("%-10s", config.streamVariants[v]->name);
+        for (double gbPerSec : table[v])
+            printf(" %8.2lf", gbPerSec);
+        printf("\n");
+    }
+}
+
+// Value of a /sys/kernel/mm/transparent_hugepage setting: the selected one
+// for the "always [madvise] never" kind, the raw value otherwise, empty if
+// it can't be read.
+string readThpSetting(const char *name)
+{
+    ifstream ifs(string("/sys/kernel/mm/transparent_hugepage/") + name);
+    string str;
+    if (!ifs || !getline(ifs, str))
+        return "";
+    const size_t open = str.find('[');
+    const size_t close = str.find(']');
+    if (open != string::npos && close != string::npos && close > open)
+        return str.substr(open + 1, close - open - 1);
+    return str;
+}
+
+static const char * const thpSettings[] = {
+    "enabled", "defrag", "shmem_enabled", "use_zero_page", "hpage_pmd_size",
+    "khugepaged/defrag", "khugepaged/max_ptes_none",
+    "khugepaged/pages_to_scan", "khugepaged/scan_sleep_millisecs",
+    "khugepaged/alloc_sleep_millisecs",
+};
+
+// Counters of /proc/vmstat telling how the THP faults and collapses of a run
+// went
+static const char * const vmstatCounters[] = {
+    "thp_fault_alloc", "thp_fault_fallback", "thp_fault_fallback_charge",
+    "thp_collapse_alloc", "thp_collapse_alloc_failed", "thp_split_page",
+    "thp_split_pmd", "compact_stall", "compact_success", "compact_fail",
+};
+#define NUM_VMSTAT_COUNTERS (sizeof(vmstatCounters) / sizeof(vmstatCounters[0]))
+
+// Current value of the vmstatCounters, 0 for the ones this kernel doesn't
+// have
+vector<unsigned long> readVmstat()
+{
+    vector<unsigned long> values(NUM_VMSTAT_COUNTERS);
+    ifstream ifs("/proc/vmstat");
+    string name;
+    unsigned long value;
+    while (ifs >> name >> value) {
+        for (size_t i = 0; i < NUM_VMSTAT_COUNTERS; ++i) {
+            if (name == vmstatCounters[i])
+                values[i] = value;
+        }
+    }
+    return values;
+}
+
+// Antagonist: keeps faulting 4kB pages in and freeing every other one, so
+// the free memory the array's huge pages come from is scattered 4kB holes
+// that need compaction. Holds at most budgetBytes, then starts over.
+void antagonist(unsigned long budgetBytes, const atomic<bool> *stop)
+{
+    const unsigned long pageBytes = sysconf(_SC_PAGESIZE);
+    const unsigned long chunkBytes = 64UL << 20;
+    vector<char *> chunks;
+    unsigned long held = 0;
+    while (!stop->load(memory_order_relaxed)) {
+        if (held + chunkBytes / 2 > budgetBytes) {
+            for (char *chunk : chunks)
+                munmap(chunk, chunkBytes);
+            chunks.clear();
+            held = 0;
+        }
+        char * const chunk = (char *) mmap(nullptr, chunkBytes,
+                PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+        if (chunk == MAP_FAILED) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            continue;
+        }
+        madvise(chunk, chunkBytes, MADV_NOHUGEPAGE);
+        for (unsigned long off = 0; off < chunkBytes; off += pageBytes)
+            chunk[off] = 1;
+        // MADV_DONTNEED rather than munmap, so we don't split the mapping
+        // into thousands of VMAs
+        for (unsigned long off = pageBytes; off < chunkBytes; off += 2 * pageBytes)
+            madvise(chunk + off, pageBytes, MADV_DONTNEED);
+        chunks.push_back(chunk);
+        held += chunkBytes / 2;
+    }
+    for (char *chunk : chunks)
+        munmap(chunk, chunkBytes);
+}
+
+// Asks the kernel for a full compaction every periodMs until stopped
+void compactor(unsigned long periodMs, const atomic<bool> *stop)
+{
+    bool warned = false;
+    while (!stop->load(memory_order_relaxed)) {
+        const auto until = chrono::steady_clock::now()
+                         + chrono::milliseconds(periodMs);
+        const int fd = open("/proc/sys/vm/compact_memory", O_WRONLY | O_CLOEXEC);
+        const bool ok = fd >= 0 && write(fd, "1", 1) == 1;
+        if (fd >= 0)
+            close(fd);
+        if (!ok && !warned) {
+            puts("Can't write /proc/sys/vm/compact_memory, run as root");
+            warned = true;
+        }
+        while (!stop->load(memory_order_relaxed)
+            && chrono::steady_clock::now() < until) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+}
+
+// The background load of --antagonists and --compact-every, running for the
+// whole of a run
+struct Interference {
+    atomic<bool> stopping{false};
+    vector<thread> threads;
+
+    void start(const Config &config)
+    {
+        for (unsigned long i = 0; i < config.antagonists; ++i) {
+            threads.emplace_back(antagonist, config.antagonistMib << 20,
+                                 &stopping);
+        }
+        if (config.compactEveryMs) {
+            threads.emplace_back(compactor, config.compactEveryMs, &stopping);
+        }
+    }
+    void stop()
+    {
+        stopping = true;
+        for (thread &th : threads) {
+            th.join();
+        }
+        threads.clear();
+    }
+    ~Interference() { stop(); }
+};
+
+// What the kernel did for the THP faults of the run
+void vmstatPhase(const vector<unsigned long> &before, RunResult *run)
+{
+    const vector<unsigned long> after = readVmstat();
+    PhaseResult phase;
+    phase.name = "Vmstat";
+    printf("vmstat:");
+    for (size_t i = 0; i < NUM_VMSTAT_COUNTERS; ++i) {
+        const unsigned long delta = after[i] - before[i];
+        printf("%s %s +%lu", i ? "," : "", vmstatCounters[i], delta);
+        phase.metrics.emplace_back(vmstatCounters[i], delta);
+    }
+    printf("\n");
+    run->phases.push_back(phase);
+}
+
+#ifndef MADV_COLLAPSE
+// Linux 6.1
+#define MADV_COLLAPSE 25
+#endif
+
+// --collapse: the array was faulted in with 4kB pages, now it may get huge
+// pages. Round 0 is the access phase on 4kB pages, then every round either
+// MADV_COLLAPSEs the next 1/rounds of the array (madvise) or waits
+// --collapse-interval for khugepaged (khugepaged), and runs the access phase
+// again. The "Collapse#N" phases have the time it took, how much of the
+// array is on THP by then and the collapse counters so far.
+bool collapsePhases(const Config &config, const Indices &indices, void *mem,
+                    PerfCounters &counters, RunResult *run)
+{
+    // Undo the MADV_NOHUGEPAGE of 4kB mappings, khugepaged only looks at
+    // MADV_HUGEPAGE ones with enabled = madvise
+    if (madvise(mem, config.mapSize, MADV_HUGEPAGE)) {
+        perror("madvise MADV_HUGEPAGE");
+        return false;
+    }
+    const vector<unsigned long> vmstatBefore = readVmstat();
+    const unsigned long collapsedBefore =
+        strtoul(readThpSetting("khugepaged/pages_collapsed").c_str(), nullptr, 0);
+    const unsigned long rounds = config.collapseRounds;
+    const unsigned long hugeBytes = 2UL << 20;
+    vector<pair<string, double>> curve;
+    for (unsigned long r = 0; r <= rounds; ++r) {
+        const string suffix = "#" + to_string(r);
+        if (r > 0) {
+            const auto start = chrono::steady_clock::now();
+            if (config.collapse == COLLAPSE_MADVISE) {
+                const unsigned long chunks = config.mapSize / hugeBytes;
+                const unsigned long begin = chunks * (r - 1) / rounds * hugeBytes;
+                const unsigned long end = chunks * r / rounds * hugeBytes;
+                // EAGAIN and ENOMEM when some of it can't be collapsed, the
+                // residency says how much was
+                if (end > begin
+                 && madvise((char *) mem + begin, end - begin, MADV_COLLAPSE)
+                 && errno != EAGAIN && errno != ENOMEM) {
+                    perror("madvise MADV_COLLAPSE");
+                    return false;
+                }
+            } else {
+                this_thread::sleep_for(chrono::milliseconds(config.collapseIntervalMs));
+            }
+            const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            Residency res;
+            readSmaps(mem, config.mapSize, &res);
+            const double thpPct = 100.0 * res.thpKib / (config.mapSize / 1024.0);
+            const vector<unsigned long> vmstatNow = readVmstat();
+            const unsigned long collapsed =
+                strtoul(readThpSetting("khugepaged/pages_collapsed").c_str(), nullptr, 0);
+            printf("Collapse round %lu took %.4lf secs, THP %.1lf%% of the "
+                   "array\n", r, elapsed.count(), thpPct);
+
+            PhaseResult phase;
+            phase.name = "Collapse" + suffix;
+            phase.metrics.emplace_back("secs", elapsed.count());
+            phase.metrics.emplace_back("thp_pct", thpPct);
+            for (size_t i = 0; i < NUM_VMSTAT_COUNTERS; ++i) {
+                if (!strncmp(vmstatCounters[i], "thp_collapse", 12))
+                    phase.metrics.emplace_back(vmstatCounters[i],
+                                               vmstatNow[i] - vmstatBefore[i]);
+            }
+            phase.metrics.emplace_back("khugepaged_pages_collapsed",
+                                       collapsed - collapsedBefore);
+            run->phases.push_back(phase);
+            curve.emplace_back(to_string(r) + " (THP " + to_string(int(thpPct + 0.5)) + "%)", 0);
+        } else {
+            curve.emplace_back("0 (4kB)", 0);
+        }
+        if (config.chase) {
+            accessPhase(config, indices, mem, nullptr, counters, run, suffix);
+        } else {
+            for (const AccessKernel *kernel : config.kernels)
+                accessPhase(config, indices, mem, kernel, counters, run, suffix);
+        }
+        curve.back().second = run->phases.back().metrics[0].second;
+    }
+
+    puts("Collapse rounds, secs of the last access phase:");
+    for (const auto &point : curve)
+        printf("%s %.4lf\n", point.first.c_str(), point.second);
+    return true;
+}
+
+// Page tables of the calling process, VmPTE of /proc/self/status, in kB. 0
+// if it can't be read.
+unsigned long readVmPteKib()
+{
+    ifstream ifs("/proc/self/status");
+    string line;
+    while (getline(ifs, line)) {
+        unsigned long kib;
+        if (sscanf(line.c_str(), "VmPTE: %lu kB", &kib) == 1)
+            return kib;
+    }
+    return 0;
+}
+
+// What a reader process sends back, in one write, atomic on a pipe
+struct ReaderResult {
+    unsigned long reader;
+    double secs;
+    double result;
+    unsigned long lastIdx;
+    unsigned long vmPteKib;
+};
+
+// --processes: instead of accessing the array itself, fork that many reader
+// processes which all run the access phase at the same time on the mapping
+// they inherit. Each one gets a "Reader#N" phase with its fork time, the
+// time of its access phase and its page tables once done, and the "Readers"
+// phase sums them up.
+bool readerPhases(const Config &config, const Indices &indices, void *mem,
+                  PerfCounters &counters, RunResult *run)
+{
+    const unsigned long numReaders = config.processes;
+    int startPipe[2], resultPipe[2];
+    if (pipe(startPipe)) {
+        perror("pipe");
+        return false;
+    }
+    if (pipe(resultPipe)) {
+        perror("pipe");
+        close(startPipe[0]);
+        close(startPipe[1]);
+        return false;
+    }
+    const unsigned long parentPteKib = readVmPteKib();
+    // Or the readers would print what's still buffered again
+    fflush(stdout);
+
+    vector<pid_t> pids;
+    vector<double> forkSecs;
+    for (unsigned long r = 0; r < numReaders; ++r) {
+        const auto start = chrono::steady_clock::now();
+        const pid_t pid = fork();
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            close(startPipe[1]);
+            close(resultPipe[0]);
+            // Every reader starts once the last one is forked and the
+            // parent closes its end
+            char c;
+            while (read(startPipe[0], &c, 1) < 0 && errno == EINTR) {
+            }
+            // Each reader on its own CPUs
+            Config reader = config;
+            if (config.pin) {
+                rotate(reader.cpus.begin(),
+                       reader.cpus.begin() + r * config.numThreads % reader.cpus.size(),
+                       reader.cpus.end());
+            }
+            RunResult readerRun;
+            const string suffix = "#" + to_string(r);
+            accessPhase(reader, indices, mem,
+                        config.chase ? nullptr : config.kernels[0], counters,
+                        &readerRun, suffix);
+            ReaderResult res;
+            res.reader = r;
+            res.secs = readerRun.phases.back().metrics[0].second;
+            res.result = readerRun.result;
+            res.lastIdx = readerRun.lastIdx;
+            res.vmPteKib = readVmPteKib();
+            const bool sent = write(resultPipe[1], &res, sizeof(res)) == sizeof(res);
+            fflush(stdout);
+            _exit(sent ? 0 : 1);
+        }
+        pids.push_back(pid);
+        forkSecs.push_back(elapsed.count());
+    }
+    close(startPipe[0]);
+    close(startPipe[1]);
+    close(resultPipe[1]);
+
+    vector<ReaderResult> results;
+    ReaderResult res;
+    ssize_t got;
+    while ((got = read(resultPipe[0], &res, sizeof(res))) == sizeof(res)
+        || (got < 0 && errno == EINTR)) {
+        if (got > 0)
+            results.push_back(res);
+    }
+    close(resultPipe[0]);
+    bool ok = pids.size() == numReaders;
+    for (pid_t pid : pids) {
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+         || WEXITSTATUS(status)) {
+            ok = false;
+        }
+    }
+    if (!ok || results.size() != numReaders) {
+        puts("A reader failed, a private hugetlbfs mapping gets SIGBUS when "
+             "the pool can't cover the copies on write");
+        return false;
+    }
+    sort(results.begin(), results.end(),
+         [](const ReaderResult &a, const ReaderResult &b) {
+        return a.reader < b.reader;
+    });
+
+    double maxSecs = 0, maxForkSecs = 0, totalForkSecs = 0;
+    unsigned long totalPteKib = 0;
+    for (const ReaderResult &reader : results) {
+        const double fork = forkSecs[reader.reader];
+        printf("Reader %lu: fork took %.3lf ms, access took %.4lf secs, "
+               "VmPTE %lu kB\n", reader.reader, fork * 1e3, reader.secs,
+               reader.vmPteKib);
+        PhaseResult phase;
+        phase.name = "Reader#" + to_string(reader.reader);
+        phase.metrics.emplace_back("fork_secs", fork);
+        phase.metrics.emplace_back("secs", reader.secs);
+        phase.metrics.emplace_back("vm_pte_kib", reader.vmPteKib);
+        run->phases.push_back(phase);
+        maxSecs = max(maxSecs, reader.secs);
+        maxForkSecs = max(maxForkSecs, fork);
+        totalForkSecs += fork;
+        totalPteKib += reader.vmPteKib;
+    }
+    printf("%lu readers: slowest access %.4lf secs, fork %.3lf ms on average "
+           "(max %.3lf ms), page tables %lu kB in the readers, %lu kB in the "
+           "parent\n", numReaders, maxSecs, totalForkSecs / numReaders * 1e3,
+           maxForkSecs * 1e3, totalPteKib, parentPteKib);
+    PhaseResult phase;
+    phase.name = "Readers";
+    phase.metrics.emplace_back("max_secs", maxSecs);
+    phase.metrics.emplace_back("mean_fork_secs", totalForkSecs / numReaders);
+    phase.metrics.emplace_back("max_fork_secs", maxForkSecs);
+    phase.metrics.emplace_back("vm_pte_kib", totalPteKib);
+    phase.metrics.emplace_back("parent_vm_pte_kib", parentPteKib);
+    run->phases.push_back(phase);
+    // Same indices in every reader, same result
+    run->result = results[0].result;
+    run->lastIdx = results[0].lastIdx;
+    return true;
+}
+
+// Map, initialize and access the array once, printing progress as it goes.
+bool runOnce(const Config &config, const Indices &indices,
+             PerfCounters &counters, RunResult *run)
+{
+    const unsigned long arraySize = config.arraySize;
+    const unsigned long endIdx = config.endIdx;
+    const unsigned long pageSizeKib = config.pageSizeKib;
+    const unsigned long pageBytes = config.pageBytes;
+    const unsigned long numPages = config.numPages;
+    const unsigned long mapSize = config.mapSize;
+    const unsigned long numThreads = config.numThreads;
+    const bool hugetlb = config.hugetlb, thp = config.thp;
+    const bool chase = config.chase;
+    const Prefault prefault = config.prefault;
+    const vector<int> &cpus = config.cpus;
+    const vector<int> &memNodes = config.memNodes;
+
+    // Check the pool first, mmap would only say ENOMEM
+    long freeBefore = 0;
+    if (hugetlb) {
+        freeBefore = freeHugePages(pageSizeKib, memNodes);
+        if (freeBefore < 0) {
+            printf("No %lukB hugetlbfs pool, this kernel or CPU doesn't "
+                   "support that page size\n", pageSizeKib);
+            return false;
+        }
+        if ((unsigned long) freeBefore < numPages) {
+            printf("You must have at least %lu free %lukB hugetlbfs pages%s, "
+                   "only %ld are. Check "
+                   "/sys/kernel/mm/hugepages/hugepages-%lukB/free_hugepages "
+                   "and adjust if necessary with hugeadm\n", numPages,
+                   pageSizeKib, memNodes.empty() ? "" : " on the bound nodes",
+                   freeBefore, pageSizeKib);
+            return false;
+        }
+    }
+
+    int fd;
+    if (!openBacking(config, &fd)) {
+        return false;
+    }
+
+    // What THP does depends as much on these as on the madvise
+    if (thp || config.collapse != COLLAPSE_NONE) {
+        printf("THP settings:");
+        for (size_t i = 0; i < sizeof(thpSettings) / sizeof(thpSettings[0]); ++i) {
+            printf("%s %s %s", i ? "," : "", thpSettings[i],
+                   readThpSetting(thpSettings[i]).c_str());
+        }
+        printf("\n");
+    }
+
+    // Other tenants fragmenting memory while we fault the array in and use it
+    const bool vmstat = config.thp || config.collapse != COLLAPSE_NONE
+                     || config.antagonists || config.compactEveryMs;
+    const vector<unsigned long> vmstatBefore = readVmstat();
+    Interference interference;
+    if (config.antagonists || config.compactEveryMs) {
+        printf("Starting %lu antagonist%s%s\n", config.antagonists,
+               config.antagonists == 1 ? "" : "s",
+               config.compactEveryMs ? " and periodic compaction" : "");
+        interference.start(config);
+    }
+    // The array gets mapped the way huge_page_arena.h maps memory for
+    // everyone else, without the fallback: it has to be the page size asked
+    // for.
+    hugepages::Options options;
+    options.kind = !hugetlb ? (thp ? hugepages::PAGE_THP : hugepages::PAGE_4K)
+                 : pageSizeKib == 2048 ? hugepages::PAGE_2M : hugepages::PAGE_1G;
+    options.fallback = false;
+    options.nodes = memNodes;
+    options.populate = prefault == PREFAULT_POPULATE;
+    options.fd = fd;
+    // With MAP_POPULATE, mmap is the fault phase
+    chrono::time_point<chrono::steady_clock> startTime, endTime;
+    if (prefault == PREFAULT_POPULATE) {
+        puts("Faulting the array in");
+        counters.start();
+    }
+    startTime = chrono::steady_clock::now();
+    hugepages::Mapping mapping;
+    const bool mapped = hugepages::mapMemory(mapSize, options, &mapping);
+    endTime = chrono::steady_clock::now();
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (prefault == PREFAULT_POPULATE) {
+        counters.stop();
+    }
+    if (!mapped) {
+        perror("Cannot allocate memory!");
+        if (hugetlb) {
+            printf("You must have at least %lu free %lukB hugetlbfs pages. "
+                   "Check /proc/meminfo to see the number of free hugetlbfs "
+                   "pages and adjust if necessary with hugeadm\n", numPages,
+                   pageSizeKib);
+        } else if (thp) {
+            puts("mmap or madvise MADV_HUGEPAGE failed, enable THP and try "
+                 "again");
+        }
+        return false;
+    }
+    void * const mem = mapping.addr;
+
+    void * const elements = (char *) mem + elementTypes[config.element].offset;
+    const InitFn init = initSlices[config.element];
+    unsigned long * const links = (unsigned long *) mem;
+    const unsigned long numNodes = arraySize / (CHASE_STRIDE * sizeof(unsigned long));
+    const unsigned long initThreads = config.parallelInit ? numThreads : 1;
+
+    // Fault the array in on its own, so the initialization below only
+    // measures the stores.
+    chrono::duration<double> elapsed;
+    if (prefault != PREFAULT_NONE) {
+        if (prefault != PREFAULT_POPULATE) {
+            puts("Faulting the array in");
+            startTime = chrono::steady_clock::now();
+            runSliced(mapSize, pageBytes, initThreads, cpus, &counters,
+                      [&](unsigned long begin, unsigned long end) {
+                char * const bytes = (char *) mem;
+                if (prefault == PREFAULT_MADVISE) {
+                    if (begin != end
+                     && madvise(bytes + begin, end - begin, MADV_POPULATE_WRITE)) {
+                        perror("madvise MADV_POPULATE_WRITE");
+                    }
+                } else {
+                    for (unsigned long i = begin; i < end; i += 4096) {
+                        *(volatile char *) (bytes + i) = 0;
+                    }
+                }
+            });
+            endTime = chrono::steady_clock::now();
+        }
+        elapsed = endTime - startTime;
+        printf("Faulting the array in took %.4lf secs\n", elapsed.count());
+        counters.print("Faulting", 0);
+        run->add("Faulting", elapsed.count(), counters);
+    }
+
+    // Initialize the array. You won't see a dramatic difference in terms of
+    // performance between 4K and 2MB pages because the array is initialized
+    // linearly. Building the chain on the other hand does random swaps all
+    // over the array.
+    if (chase) {
+        printf("Building the chain (%lu nodes, seed %lu)\n", numNodes,
+               (unsigned long) config.seed);
+    } else {
+        puts("Initializing the array");
+    }
+    startTime = chrono::steady_clock::now();
+    asm volatile ("" ::: "memory");
+    if (chase) {
+        counters.start();
+        buildChase(links, numNodes, config.seed);
+        counters.stop();
+    } else {
+        runSliced(endIdx, max(1UL, pageBytes / elementTypes[config.element].size),
+                  initThreads, cpus, &counters,
+                  [&](unsigned long begin, unsigned long end) {
+            init(elements, begin, end);
+        });
+    }
+    asm volatile ("" ::: "memory");
+    endTime = chrono::steady_clock::now();
+    elapsed = endTime - startTime;
+    printf("Initialization of the array took %.4lf secs\n", elapsed.count());
+    counters.print("Initialization", 0);
+    run->add("Initialization", elapsed.count(), counters);
+    if (hugetlb) {
+        // Pages are taken from the pool when faulted in, not at mmap time
+        const long freeAfter = freeHugePages(pageSizeKib, memNodes);
+        printf("Array is backed by %ld %lukB hugetlbfs pages (%lu expected)\n",
+               freeBefore - freeAfter, pageSizeKib, numPages);
+    }
+    checkResidency(config, mem, run);
+
+    // Every kernel runs on the same mapping, one after the other
+    if (config.collapse != COLLAPSE_NONE) {
+        if (!collapsePhases(config, indices, mem, counters, run)) {
+            hugepages::unmapMemory(&mapping);
+            return false;
+        }
+    } else if (config.sweep) {
+        if (!sweepPhases(config, mem, counters, run)) {
+            hugepages::unmapMemory(&mapping);
+            return false;
+        }
+    } else if (config.processes) {
+        if (!readerPhases(config, indices, mem, counters, run)) {
+            hugepages::unmapMemory(&mapping);
+            return false;
+        }
+    } else if (chase) {
+        accessPhase(config, indices, mem, nullptr, counters, run);
+    } else {
+        for (const AccessKernel *kernel : config.kernels) {
+            accessPhase(config, indices, mem, kernel, counters, run);
+        }
+    }
+    if (config.latencyMode) {
+        latencyPhase(config, indices, mem, run);
+    }
+    if (!config.streamVariants.empty()) {
+        streamPhases(config, mem, mapping.kind, counters, run);
+    }
+
+    interference.stop();
+    if (vmstat) {
+        vmstatPhase(vmstatBefore, run);
+    }
+    hugepages::unmapMemory(&mapping);
+    return true;
+}
+
+// One metric (elapsed time or a counter) of one phase, over every run
+struct Metric {
+    string phase, name;
+    vector<double> values;
+};
+
+// Group the results of every run by phase and metric, in the order they
+// first appear.
+vector<Metric> collectMetrics(const vector<RunResult> &runs)
+{
+    vector<Metric> metrics;
+    auto find = [&](const string &phase, const string &name) -> Metric & {
+        for (Metric &metric : metrics) {
+            if (metric.phase == phase && metric.name == name)
+                return metric;
+        }
+        metrics.push_back(Metric{phase, name, {}});
+        return metrics.back();
+    };
+    for (const RunResult &run : runs) {
+        for (const PhaseResult &phase : run.phases) {
+            for (const auto &metric : phase.metrics)
+                find(phase.name, metric.first).values.push_back(metric.second);
+        }
+    }
+    return metrics;
+}
+
+string jsonList(const vector<int> &list)
+{
+    string out = "[";
+    for (size_t i = 0; i < list.size(); ++i)
+        out += (i ? ", " : "") + to_string(list[i]);
+    return out + "]";
+}
+
+void printJson(FILE *out, const Config &config, const vector<RunResult> &runs)
+{
+    struct utsname uts;
+    uname(&uts);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"array_size\": %lu,\n", config.arraySize);
+    fprintf(out, "    \"page_size_kib\": %lu,\n", config.pageSizeKib);
+    fprintf(out, "    \"thp\": %s,\n", config.thp ? "true" : "false");
+    fprintf(out, "    \"hugetlb\": %s,\n", config.hugetlb ? "true" : "false");
+    fprintf(out, "    \"threads\": %lu,\n", config.numThreads);
+    fprintf(out, "    \"cpu_nodes\": %s,\n", jsonList(config.cpuNodes).c_str());
+    fprintf(out, "    \"mem_nodes\": %s,\n", jsonList(config.memNodes).c_str());
+    fprintf(out, "    \"pattern\": %s,\n", jsonString(config.pattern->name).c_str());
+    fprintf(out, "    \"stride\": %lu,\n", config.strideBytes);
+    fprintf(out, "    \"zipf_skew\": %g,\n", config.zipfSkew);
+    fprintf(out, "    \"hot_set_mib\": %lu,\n", config.hotSetMib);
+    if (config.seeded)
+        fprintf(out, "    \"seed\": %lu,\n", (unsigned long) config.seed);
+    else
+        fprintf(out, "    \"seed\": null,\n");
+    fprintf(out, "    \"accesses\": %lu,\n", config.numIndices);
+    fprintf(out, "    \"kernels\": [");
+    for (size_t i = 0; i < config.kernels.size(); ++i)
+        fprintf(out, "%s%s", i ? ", " : "",
+                jsonString(config.kernels[i]->name).c_str());
+    fprintf(out, "],\n");
+    fprintf(out, "    \"stream\": [");
+    for (size_t i = 0; i < config.streamVariants.size(); ++i)
+        fprintf(out, "%s%s", i ? ", " : "",
+                jsonString(config.streamVariants[i]->name).c_str());
+    fprintf(out, "],\n");
+    fprintf(out, "    \"prefetch_distance\": %lu,\n",
+            config.kernelParams.prefetchDistance);
+    fprintf(out, "    \"accumulators\": %lu,\n",
+            config.kernelParams.accumulators);
+    fprintf(out, "    \"element\": %s,\n",
+            jsonString(elementTypes[config.element].name).c_str());
+    fprintf(out, "    \"op\": %s,\n", jsonString(opNames[config.op]).c_str());
+    fprintf(out, "    \"indices\": %s,\n",
+            jsonString(indexModeNames[config.indexMode]).c_str());
+    fprintf(out, "    \"backing\": %s,\n",
+            jsonString(backingNames[config.backing]).c_str());
+    fprintf(out, "    \"backing_path\": %s,\n",
+            jsonString(config.backingPath).c_str());
+    fprintf(out, "    \"latency\": %s,\n", config.latencyMode ? "true" : "false");
+    fprintf(out, "    \"sweep\": %s,\n", config.sweep ? "true" : "false");
+    fprintf(out, "    \"collapse\": %s,\n",
+            jsonString(collapseNames[config.collapse]).c_str());
+    fprintf(out, "    \"collapse_rounds\": %lu,\n", config.collapseRounds);
+    fprintf(out, "    \"processes\": %lu,\n", config.processes);
+    fprintf(out, "    \"latency_batch\": %lu,\n", config.latency.batch);
+    fprintf(out, "    \"latency_every\": %lu,\n", config.latency.every);
+    fprintf(out, "    \"antagonists\": %lu,\n", config.antagonists);
+    fprintf(out, "    \"antagonist_mib\": %lu,\n", config.antagonistMib);
+    fprintf(out, "    \"compact_every_ms\": %lu,\n", config.compactEveryMs);
+    fprintf(out, "    \"prefault\": %s,\n",
+            jsonString(prefaultNames[config.prefault]).c_str());
+    fprintf(out, "    \"parallel_init\": %s,\n",
+            config.parallelInit ? "true" : "false");
+    fprintf(out, "    \"min_coverage\": %g,\n", config.minCoverage);
+    fprintf(out, "    \"repeat\": %lu\n", config.repeat);
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"kernel\": {\n");
+    fprintf(out, "    \"sysname\": %s,\n", jsonString(uts.sysname).c_str());
+    fprintf(out, "    \"release\": %s,\n", jsonString(uts.release).c_str());
+    fprintf(out, "    \"version\": %s,\n", jsonString(uts.version).c_str());
+    fprintf(out, "    \"machine\": %s\n", jsonString(uts.machine).c_str());
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"transparent_hugepage\": {\n");
+    const size_t numSettings = sizeof(thpSettings) / sizeof(thpSettings[0]);
+    for (size_t i = 0; i < numSettings; ++i) {
+        fprintf(out, "    %s: %s%s\n", jsonString(thpSettings[i]).c_str(),
+                jsonString(readThpSetting(thpSettings[i])).c_str(),
+                i + 1 < numSettings ? "," : "");
+    }
+    fprintf(out, "  },\n");
+
+    // Per phase, per metric summary plus the value of every run
+    const vector<Metric> metrics = collectMetrics(runs);
+    fprintf(out, "  \"phases\": {");
+    string lastPhase;
+    for (size_t i = 0; i < metrics.size(); ++i) {
+        const Metric &metric = metrics[i];
+        if (metric.phase != lastPhase) {
+            fprintf(out, "%s\n    %s: {", lastPhase.empty() ? "" : "\n    },",
+                    jsonString(metric.phase).c_str());
+            lastPhase = metric.phase;
+        } else {
+            fprintf(out, ",");
+        }
+        const Stats stats = computeStats(metric.values);
+        fprintf(out, "\n      %s: {\"min\": %.9g, \"median\": %.9g, "
+                "\"p99\": %.9g, \"mean\": %.9g, \"values\": [",
+                jsonString(metric.name).c_str(), stats.min, stats.median,
+                stats.p99, stats.mean);
+        for (size_t v = 0; v < metric.values.size(); ++v)
+            fprintf(out, "%s%.9g", v ? ", " : "", metric.values[v]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "%s\n  },\n", lastPhase.empty() ? "" : "\n    }");
+
+    bool valid = true;
+    for (const RunResult &run : runs)
+        valid &= run.valid;
+    fprintf(out, "  \"valid\": %s,\n", valid ? "true" : "false");
+    fprintf(out, "  \"result\": ");
+    if (runs.empty())
+        fprintf(out, "null\n");
+    else if (config.chase)
+        fprintf(out, "%lu\n", runs.back().lastIdx);
+    else
+        fprintf(out, "%.9g\n", runs.back().result);
+    fprintf(out, "}\n");
+}
+
+// One line per phase and metric, with the config repeated on every line so
+// rows from different runs of the binary can be concatenated.
+void printCsv(FILE *out, const Config &config, const vector<RunResult> &runs)
+{
+    struct utsname uts;
+    uname(&uts);
+
+    bool valid = true;
+    for (const RunResult &run : runs)
+        valid &= run.valid;
+
+    fprintf(out, "kernel,array_size,page_size_kib,thp,hugetlb,backing,threads,pattern,"
+            "element,op,indices,prefault,parallel_init,thp_enabled,thp_defrag,valid,phase,metric,"
+            "runs,min,median,p99,mean\n");
+    for (const Metric &metric : collectMetrics(runs)) {
+        const Stats stats = computeStats(metric.values);
+        fprintf(out, "%s,%lu,%lu,%d,%d,%s,%lu,%s,%s,%s,%s,%s,%d,%s,%s,%d,%s,%s,%zu,"
+                "%.9g,%.9g,%.9g,%.9g\n", uts.release, config.arraySize,
+                config.pageSizeKib, config.thp, config.hugetlb, backingNames[config.backing],
+                config.numThreads,
+                config.pattern->name, elementTypes[config.element].name,
+                opNames[config.op], indexModeNames[config.indexMode],
+                prefaultNames[config.prefault],
+                config.parallelInit, readThpSetting("enabled").c_str(),
+                readThpSetting("defrag").c_str(), valid, metric.phase.c_str(),
+                metric.name.c_str(), metric.values.size(), stats.min,
+                stats.median, stats.p99, stats.mean);
+    }
+}
+
+// Checks the options that go together and derives the rest of the config
+// (page size, mapping size, CPUs, pattern parameters) from them. False, after
+// printing why, if they don't make sense.
+bool setupConfig(Config &config)
+{
+    // MAP_POPULATE faults everything in before we get a chance to madvise
+    // or mbind
+    if (config.prefault == PREFAULT_POPULATE
+     && (config.thp || !config.memNodes.empty())) {
+        puts("--prefault populate can't be used with -m or --mem-node, use "
+             "--prefault madvise instead");
+        return false;
+    }
+
+    // hugetlbfs mounts have one page size, the array gets that one
+    if (config.backing == BACKING_HUGETLBFS) {
+        struct statfs sfs;
+        if (statfs(config.backingPath.c_str(), &sfs)
+         || (unsigned long) sfs.f_type != HUGETLBFS_MAGIC) {
+            printf("%s is not a hugetlbfs mount\n", config.backingPath.c_str());
+            return false;
+        }
+        const unsigned long mountKib = sfs.f_bsize / 1024;
+        if (config.thp || (config.pageSizeKib && config.pageSizeKib != mountKib)) {
+            printf("%s has %lukB pages\n", config.backingPath.c_str(),
+                   mountKib);
+            return false;
+        }
+        config.pageSizeKib = mountKib;
+        config.hugetlb = true;
+    }
+    if (config.backing == BACKING_FILE && config.hugetlb) {
+        puts("Use --backing hugetlbfs:PATH for hugetlbfs files");
+        return false;
+    }
+
+    if (!keepSupported(&config.kernels, config.allKernels, "kernel")
+     || !keepSupported(&config.streamVariants, config.allStreamVariants,
+                       "stream variant")) {
+        return false;
+    }
+    if (config.kernels.empty()) {
+        config.kernels.push_back(&accessKernels[0]);
+    }
+    const ElementType &elementType = elementTypes[config.element];
+    if (config.element != ELEMENT_F64 && !config.pattern->index) {
+        puts("--element doesn't apply to --pattern chase");
+        return false;
+    }
+    // The chase only reads, with its own loop
+    if (!config.pattern->index
+     && (config.op != OP_READ || config.kernels.size() != 1
+      || config.kernels[0] != &accessKernels[0])) {
+        puts("--op and --kernel don't apply to --pattern chase");
+        return false;
+    }
+    for (size_t k = 0; k < config.kernels.size(); ++k) {
+        const AccessKernel *kernel = config.kernels[k];
+        if (kernel->add[config.element])
+            continue;
+        printf("Kernel %s doesn't do %s elements\n", kernel->name,
+               elementType.name);
+        if (!config.allKernels)
+            return false;
+        config.kernels.erase(config.kernels.begin() + k--);
+    }
+    config.endIdx = (config.arraySize - elementType.offset) / elementType.size;
+    if (config.op != OP_READ
+     && (config.kernels.size() != 1 || config.kernels[0] != &accessKernels[0])) {
+        puts("--op write, rmw and atomic only run with the scalar kernel");
+        return false;
+    }
+    if (config.indexMode != INDEX_STORED
+     && (!config.pattern->index || config.op != OP_READ || config.latencyMode
+      || config.kernels.size() != 1 || config.kernels[0] != &accessKernels[0])) {
+        puts("--indices u32 and inline only run the scalar kernel reading, "
+             "without --latency or --pattern chase");
+        return false;
+    }
+    if (config.indexMode == INDEX_INLINE
+     && config.pattern != findPattern("uniform")) {
+        puts("--indices inline only generates uniform indices");
+        return false;
+    }
+    if (config.indexMode == INDEX_U32 && config.endIdx - 1 > UINT32_MAX) {
+        printf("%lu elements don't fit in 32-bit indices\n", config.endIdx);
+        return false;
+    }
+
+    if (!config.pageSizeKib) {
+        config.pageSizeKib = config.hugetlb || config.thp ? 2048 : 4;
+    }
+    if (config.pageSizeKib > 4 && !config.thp) {
+        config.hugetlb = true;
+    }
+    config.pageBytes = config.pageSizeKib * 1024;
+    config.numPages = (config.arraySize + config.pageBytes - 1) / config.pageBytes;
+    // mmap wants a multiple of the hugetlbfs page size
+    config.mapSize = config.numPages * config.pageBytes;
+
+    if (config.pin && !getCpus(config.cpuNodes, &config.cpus)) {
+        return false;
+    }
+    if (config.pin && config.cpus.size() < config.numThreads) {
+        printf("Only %zu CPUs available for %lu threads, some will share a "
+               "CPU\n", config.cpus.size(), config.numThreads);
+    }
+
+    if (config.latencyMode) {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+            puts("No invariant TSC, the latencies may be off");
+        }
+        config.latency.overhead = rdtscpOverhead();
+        config.tscPerNs = tscPerNs();
+        printf("TSC runs at %.3lf GHz, rdtscp takes %lu cycles\n",
+               config.tscPerNs, config.latency.overhead);
+    }
+
+    // Number of accesses into the array we'll bench: 3% of the total
+    config.numIndices = config.endIdx * 0.03;
+
+    if (config.sweep && config.latencyMode) {
+        puts("--latency doesn't go with --sweep");
+        return false;
+    }
+    if (config.collapse != COLLAPSE_NONE
+     && (config.thp || config.hugetlb || config.sweep || config.latencyMode)) {
+        puts("--collapse starts from 4kB pages, it doesn't go with -m, -t, "
+             "--page-size, --sweep or --latency");
+        return false;
+    }
+    // Forking with the interference threads running would leave the readers
+    // with whatever locks those held
+    if (config.processes
+     && (config.sweep || config.collapse != COLLAPSE_NONE || config.latencyMode
+      || config.antagonists || config.compactEveryMs || config.kernels.size() > 1)) {
+        puts("--processes runs a single kernel, without --sweep, --collapse, "
+             "--latency, --antagonists or --compact-every");
+        return false;
+    }
+    config.chase = !config.pattern->index;
+    const bool uniform = config.pattern == findPattern("uniform");
+    // CACHED_INDICES_FILE only holds 64-bit uniform indices of the whole
+    // array, other patterns, the sweep and the other index modes are always
+    // generated in memory with a random seed if none was given.
+    if (!config.seeded
+     && (!uniform || config.sweep || config.indexMode != INDEX_STORED)) {
+        random_device rdev;
+        config.seed = (uint64_t(rdev()) << 32) | rdev();
+        config.seeded = true;
+    }
+    PatternParams &params = config.params;
+    params.endIdx = config.endIdx;
+    params.seed = config.seed;
+    params.stride = max(1UL, config.strideBytes / elementType.size);
+    params.zipfSkew = config.zipfSkew;
+    params.zipfScatter = coprimeScatter(config.endIdx);
+    params.hotSetIdx = min(config.endIdx,
+                           config.hotSetMib * 1024 * 1024 / elementType.size);
+
+    return true;
+}
+
+// The indices of the accesses to bench, from the seed or the file. Chase
+// doesn't have any, and the sweep makes its own.
+bool getIndices(const Config &config, Indices *indices)
+{
+    if (config.chase) {
+        // The chain lives in the array itself, it just needs the seed
+    } else if (config.sweep) {
+        // Generated for each size
+    } else if (config.indexMode == INDEX_INLINE) {
+        printf("Generating %lu uniform indices from seed %lu in the loop\n",
+               config.numIndices, (unsigned long) config.seed);
+    } else if (config.seeded) {
+        puts("Getting the indices");
+        // Use every CPU we have, that's what makes it quicker than the file
+        const unsigned long genThreads = max(1U, thread::hardware_concurrency());
+        const auto genStart = chrono::steady_clock::now();
+        if (!generateSeededIndices(indices, *config.pattern, config.params,
+                                   config.numIndices, genThreads,
+                                   config.indexMode == INDEX_U32)) {
+            puts("Can't get indices");
+            return false;
+        }
+        const chrono::duration<double> genElapsed =
+            chrono::steady_clock::now() - genStart;
+        printf("Generated %lu %s %s indices (%.1lf MiB) from seed %lu with %lu "
+               "threads in %.4lf secs\n", config.numIndices,
+               config.pattern->name, indexModeNames[config.indexMode],
+               indices->mapSize / (1024.0 * 1024.0), (unsigned long) config.seed,
+               genThreads, genElapsed.count());
+    } else {
+        puts("Getting the indices");
+        if (!readIndices(indices, config.endIdx, config.numIndices)) {
+            puts("Can't get indices");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// bench_runner case: one run of the array per iteration, on a smaller array
+// than the default so a sweep stays short. The phases of runOnce become
+// metrics named <phase>.<metric>.
+bool runAccessCase(harness::State &state)
+{
+    Config config;
+    config.arraySize = state.intParam("size_mib") * 1024UL * 1024UL;
+    const string &page = state.param("page");
+    if (page == "thp") {
+        config.thp = true;
+    } else if (page == "2m" || page == "1g") {
+        config.pageSizeKib = page == "2m" ? 2048 : 1024 * 1024;
+        config.hugetlb = true;
+    } else if (page != "4k") {
+        printf("Unknown page %s, 4k, thp, 2m or 1g\n", page.c_str());
+        return false;
+    }
+    config.pattern = findPattern(state.param("pattern").c_str());
+    const AccessKernel *kernel = findKernel(state.param("kernel").c_str());
+    if (!config.pattern || !kernel || !kernel->supported()) {
+        puts("Unknown pattern, or unknown or unsupported kernel");
+        return false;
+    }
+    config.kernels.push_back(kernel);
+    config.numThreads = max(1L, state.intParam("threads"));
+    config.pin = state.intParam("pin");
+    config.seeded = true;
+    config.seed = state.intParam("seed");
+    config.sweep = state.intParam("sweep");
+    config.processes = max(0L, state.intParam("processes"));
+    const string &indexMode = state.param("indices");
+    int mode = 0;
+    while (mode <= INDEX_INLINE && indexMode != indexModeNames[mode])
+        ++mode;
+    if (mode > INDEX_INLINE) {
+        printf("Unknown indices %s, stored, u32 or inline\n", indexMode.c_str());
+        return false;
+    }
+    config.indexMode = IndexMode(mode);
+    const string &stream = state.param("stream");
+    if (stream != "none") {
+        const StreamVariant *variant = findStreamVariant(stream.c_str());
+        if (!variant || !variant->supported()) {
+            printf("Unknown or unsupported stream variant %s\n", stream.c_str());
+            return false;
+        }
+        config.streamVariants.push_back(variant);
+    }
+    if (config.arraySize == 0 || !setupConfig(config)) {
+        return false;
+    }
+    Indices indices;
+    if (!getIndices(config, &indices)) {
+        return false;
+    }
+    // No --perf here, the runner only reports times
+    PerfCounters counters;
+    while (state.next()) {
+        RunResult run;
+        if (!runOnce(config, indices, counters, &run)) {
+            return false;
+        }
+        for (const PhaseResult &phase : run.phases) {
+            for (const auto &metric : phase.metrics)
+                state.record(phase.name + "." + metric.first, metric.second);
+        }
+        state.record("valid", run.valid);
+    }
+    return true;
+}
+
+static harness::Register registerAccess({
+    "memory/access",
+    "Initialization and accesses of an array per page size, see -h",
+    {{"size_mib", "1024"}, {"page", "4k,thp"}, {"pattern", "uniform"},
+     {"kernel", "scalar"}, {"threads", "1"}, {"pin", "0"}, {"seed", "1"},
+     {"sweep", "0"}, {"indices", "stored"}, {"stream", "none"},
+     {"processes", "0"}},
+    runAccessCase,
+});
+
+// Built into bench_runner with -DHUGE_MEMORY_BENCH_NO_MAIN
+#ifndef HUGE_MEMORY_BENCH_NO_MAIN
+int main(int argc, char **argv)
+{
+    Config config;
+
+    static const struct option longOptions[] = {
+        {"cpu-node", required_argument, nullptr, OPT_CPU_NODE},
+        {"mem-node", required_argument, nullptr, OPT_MEM_NODE},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"pattern", required_argument, nullptr, OPT_PATTERN},
+        {"stride", required_argument, nullptr, OPT_STRIDE},
+        {"zipf-skew", required_argument, nullptr, OPT_ZIPF_SKEW},
+        {"hot-set", required_argument, nullptr, OPT_HOT_SET},
+        {"page-size", required_argument, nullptr, OPT_PAGE_SIZE},
+        {"perf", no_argument, nullptr, OPT_PERF},
+        {"perf-walk-event", required_argument, nullptr, OPT_PERF_WALK_EVENT},
+        {"prefault", required_argument, nullptr, OPT_PREFAULT},
+        {"parallel-init", no_argument, nullptr, OPT_PARALLEL_INIT},
+        {"repeat", required_argument, nullptr, OPT_REPEAT},
+        {"format", required_argument, nullptr, OPT_FORMAT},
+        {"pagemap", no_argument, nullptr, OPT_PAGEMAP},
+        {"min-coverage", required_argument, nullptr, OPT_MIN_COVERAGE},
+        {"kernel", required_argument, nullptr, OPT_KERNEL},
+        {"prefetch-distance", required_argument, nullptr, OPT_PREFETCH_DISTANCE},
+        {"accumulators", required_argument, nullptr, OPT_ACCUMULATORS},
+        {"op", required_argument, nullptr, OPT_OP},
+        {"backing", required_argument, nullptr, OPT_BACKING},
+        {"latency", no_argument, nullptr, OPT_LATENCY},
+        {"latency-batch", required_argument, nullptr, OPT_LATENCY_BATCH},
+        {"latency-every", required_argument, nullptr, OPT_LATENCY_EVERY},
+        {"antagonists", required_argument, nullptr, OPT_ANTAGONISTS},
+        {"antagonist-mib", required_argument, nullptr, OPT_ANTAGONIST_MIB},
+        {"compact-every", required_argument, nullptr, OPT_COMPACT_EVERY},
+        {"element", required_argument, nullptr, OPT_ELEMENT},
+        {"sweep", no_argument, nullptr, OPT_SWEEP},
+        {"indices", required_argument, nullptr, OPT_INDICES},
+        {"collapse", required_argument, nullptr, OPT_COLLAPSE},
+        {"stream", required_argument, nullptr, OPT_STREAM},
+        {"processes", required_argument, nullptr, OPT_PROCESSES},
+        {"collapse-rounds", required_argument, nullptr, OPT_COLLAPSE_ROUNDS},
+        {"collapse-interval", required_argument, nullptr, OPT_COLLAPSE_INTERVAL},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hj:mts:", longOptions, nullptr))
+           != -1) {
+        switch (opt) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'j': {
+                char *endPtr;
+                config.numThreads = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.numThreads == 0
+                 || config.numThreads > CPU_SETSIZE) {
+                    usage(argv[0]);
+                }
+                config.pin = true;
+                break;
+            }
+            case OPT_CPU_NODE:
+                if (!parseList(optarg, &config.cpuNodes)
+                 || config.cpuNodes.empty()) {
+                    usage(argv[0]);
+                }
+                config.pin = true;
+                break;
+            case OPT_MEM_NODE:
+                if (!parseList(optarg, &config.memNodes)
+                 || config.memNodes.empty()) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_SEED: {
+                char *endPtr;
+                config.seed = strtoull(optarg, &endPtr, 0);
+                if (*endPtr || !*optarg) {
+                    usage(argv[0]);
+                }
+                config.seeded = true;
+                break;
+            }
+            case OPT_PATTERN:
+                config.pattern = findPattern(optarg);
+                if (!config.pattern) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_STRIDE: {
+                char *endPtr;
+                config.strideBytes = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.strideBytes == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_ZIPF_SKEW: {
+                char *endPtr;
+                config.zipfSkew = strtod(optarg, &endPtr);
+                if (*endPtr || !(config.zipfSkew > 0)) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_PAGE_SIZE:
+                if (!strcmp(optarg, "4k")) {
+                    config.pageSizeKib = 4;
+                } else if (!strcmp(optarg, "2m")) {
+                    config.pageSizeKib = 2048;
+                } else if (!strcmp(optarg, "1g")) {
+                    config.pageSizeKib = 1024 * 1024;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_PERF:
+                config.perf = true;
+                break;
+            case OPT_PERF_WALK_EVENT: {
+                char *endPtr;
+                config.walkEvent = strtoull(optarg, &endPtr, 0);
+                if (*endPtr || !config.walkEvent) {
+                    usage(argv[0]);
+                }
+                config.perf = true;
+                break;
+            }
+            case OPT_PREFAULT:
+                if (!strcmp(optarg, "none")) {
+                    config.prefault = PREFAULT_NONE;
+                } else if (!strcmp(optarg, "populate")) {
+                    config.prefault = PREFAULT_POPULATE;
+                } else if (!strcmp(optarg, "madvise")) {
+                    config.prefault = PREFAULT_MADVISE;
+                } else if (!strcmp(optarg, "touch")) {
+                    config.prefault = PREFAULT_TOUCH;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_PARALLEL_INIT:
+                config.parallelInit = true;
+                break;
+            case OPT_LATENCY:
+                config.latencyMode = true;
+                break;
+            case OPT_LATENCY_BATCH:
+            case OPT_LATENCY_EVERY: {
+                char *endPtr;
+                const unsigned long n = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || !n) {
+                    usage(argv[0]);
+                }
+                if (opt == OPT_LATENCY_BATCH)
+                    config.latency.batch = n;
+                else
+                    config.latency.every = n;
+                config.latencyMode = true;
+                break;
+            }
+            case OPT_ANTAGONISTS:
+            case OPT_ANTAGONIST_MIB:
+            case OPT_COMPACT_EVERY: {
+                char *endPtr;
+                const unsigned long n = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || (!n && opt == OPT_ANTAGONIST_MIB)) {
+                    usage(argv[0]);
+                }
+                if (opt == OPT_ANTAGONISTS)
+                    config.antagonists = n;
+                else if (opt == OPT_ANTAGONIST_MIB)
+                    config.antagonistMib = n;
+                else
+                    config.compactEveryMs = n;
+                break;
+            }
+            case OPT_SWEEP:
+                config.sweep = true;
+                break;
+            case OPT_COLLAPSE:
+                if (!strcmp(optarg, "madvise")) {
+                    config.collapse = COLLAPSE_MADVISE;
+                } else if (!strcmp(optarg, "khugepaged")) {
+                    config.collapse = COLLAPSE_KHUGEPAGED;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_COLLAPSE_ROUNDS: {
+                char *endPtr;
+                config.collapseRounds = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.collapseRounds == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_COLLAPSE_INTERVAL: {
+                char *endPtr;
+                config.collapseIntervalMs = strtoul(optarg, &endPtr, 0);
+                if (*endPtr) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_INDICES:
+                if (!strcmp(optarg, "stored")) {
+                    config.indexMode = INDEX_STORED;
+                } else if (!strcmp(optarg, "u32")) {
+                    config.indexMode = INDEX_U32;
+                } else if (!strcmp(optarg, "inline")) {
+                    config.indexMode = INDEX_INLINE;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_ELEMENT: {
+                int e = 0;
+                while (e < NUM_ELEMENTS && strcmp(elementTypes[e].name, optarg))
+                    ++e;
+                if (e == NUM_ELEMENTS) {
+                    usage(argv[0]);
+                }
+                config.element = Element(e);
+                break;
+            }
+            case OPT_BACKING:
+                if (!strcmp(optarg, "anon")) {
+                    config.backing = BACKING_ANON;
+                } else if (!strcmp(optarg, "shm")) {
+                    config.backing = BACKING_SHM;
+                } else if (!strncmp(optarg, "file:", 5) && optarg[5]) {
+                    config.backing = BACKING_FILE;
+                    config.backingPath = optarg + 5;
+                } else if (!strncmp(optarg, "hugetlbfs:", 10) && optarg[10]) {
+                    config.backing = BACKING_HUGETLBFS;
+                    config.backingPath = optarg + 10;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_OP:
+                if (!strcmp(optarg, "read")) {
+                    config.op = OP_READ;
+                } else if (!strcmp(optarg, "write")) {
+                    config.op = OP_WRITE;
+                } else if (!strcmp(optarg, "rmw")) {
+                    config.op = OP_RMW;
+                } else if (!strcmp(optarg, "atomic")) {
+                    config.op = OP_ATOMIC;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_HOT_SET: {
+                char *endPtr;
+                config.hotSetMib = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.hotSetMib == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_PROCESSES: {
+                char *endPtr;
+                config.processes = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.processes == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_REPEAT: {
+                char *endPtr;
+                config.repeat = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || config.repeat == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_FORMAT:
+                if (!strcmp(optarg, "text")) {
+                    config.format = FORMAT_TEXT;
+                } else if (!strcmp(optarg, "json")) {
+                    config.format = FORMAT_JSON;
+                } else if (!strcmp(optarg, "csv")) {
+                    config.format = FORMAT_CSV;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_PAGEMAP:
+                config.pagemap = true;
+                break;
+            case OPT_MIN_COVERAGE: {
+                char *endPtr;
+                config.minCoverage = strtod(optarg, &endPtr);
+                if (*endPtr || !(config.minCoverage >= 0)
+                 || config.minCoverage > 100) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_KERNEL:
+                // Whether this CPU runs them is checked once the output is
+                // set up
+                if (!parseNames(optarg, accessKernels, &config.kernels,
+                                &config.allKernels)) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_STREAM:
+                if (!parseNames(optarg, streamVariants, &config.streamVariants,
+                                &config.allStreamVariants)) {
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_PREFETCH_DISTANCE: {
+                char *endPtr;
+                config.kernelParams.prefetchDistance = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || !config.kernelParams.prefetchDistance) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case OPT_ACCUMULATORS: {
+                char *endPtr;
+                const unsigned long n = strtoul(optarg, &endPtr, 0);
+                if (*endPtr || (n != 2 && n != 4 && n != 8 && n != 16)) {
+                    usage(argv[0]);
+                }
+                config.kernelParams.accumulators = n;
+                break;
+            }
+            case 't':
+                config.hugetlb = true;
+                break;
+            case 'm': {
+                config.thp = true;
+                ifstream ifs("/sys/kernel/mm/transparent_hugepage/enabled");
+                bool enabled = false;
+                if (ifs) {
+                    string str;
+                    if (getline(ifs, str)
+                      && str.find("[never]") == string::npos) {
+                        enabled = true;
+                    }
+                }
+                if (!enabled) {
+                    puts("Tranparent Huge Pages are not enabled. Switch "
+                         "/sys/kernel/mm/transparent_hugepage to either "
+                         "madvise or always (madvise recommended for this "
+                         "test)");
+                    return 1;
+                }
+            } break;
+            case 's': {
+                // Override the array size. It's in GiB unless it has a
+                // suffix.
+                unsigned long bytes;
+                if (!parseSize(optarg, &bytes) || bytes == 0
+                 || bytes > 128UL * 1024 * 1024 * 1024) {
+                    // No more than 128 GiB. It's arbitrary to avoid passing
+                    // really large amounts.
+                    usage(argv[0]);
+                }
+                config.arraySize = bytes;
+                config.endIdx = config.arraySize / sizeof(double);
+                break;
+            }
+            default: usage(argv[0]);
+        }
+    }
+    if ((config.hugetlb & config.thp) || optind != argc) {
+        usage(argv[0]);
+    }
+    // THP only does PMD sized pages, anything bigger than 4k is hugetlbfs
+    if (config.thp && config.pageSizeKib && config.pageSizeKib != 2048) {
+        usage(argv[0]);
+    }
+    if (config.hugetlb && config.pageSizeKib == 4) {
+        usage(argv[0]);
+    }
+
+    // The machine readable results own stdout, everything else (including
+    // what the helpers print) goes to stderr.
+    FILE *out = stdout;
+    if (config.format != FORMAT_TEXT) {
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Can't redirect stdout");
+            return 1;
+        }
+    }
+
+    if (!setupConfig(config)) {
+        return 1;
+    }
+
+    // Counts of the current phase, from the main thread or merged from the
+    // threads doing the work
+    PerfCounters counters;
+    if (config.perf) {
+        counters.open(config.walkEvent, true);
+    }
+
+    Indices indices;
+    if (!getIndices(config, &indices)) {
+        return 1;
+    }
+
+    // Every run maps a new array, so the page faults and the huge page
+    // allocation are part of each run too.
+    vector<RunResult> runs;
+    for (unsigned long r = 0; r < config.repeat; ++r) {
+        if (config.repeat > 1) {
+            printf("Run %lu/%lu\n", r + 1, config.repeat);
+        }
+        RunResult run;
+        if (!runOnce(config, indices, counters, &run)) {
+            return 1;
+        }
+        runs.push_back(run);
+    }
+
+    if (config.format == FORMAT_JSON) {
+        printJson(out, config, runs);
+    } else if (config.format == FORMAT_CSV) {
+        printCsv(out, config, runs);
+    } else if (config.repeat > 1) {
+        printf("Over %lu runs:\n", config.repeat);
+        for (const Metric &metric : collectMetrics(runs)) {
+            const Stats stats = computeStats(metric.values);
+            printf("%s %s: min %.4lf, median %.4lf, p99 %.4lf\n",
+                   metric.phase.c_str(), metric.name.c_str(), stats.min,
+                   stats.median, stats.p99);
+        }
+    }
+    unsigned long invalid = 0;
+    for (const RunResult &run : runs)
+        invalid += !run.valid;
+    if (invalid) {
+        printf("WARNING: %lu of %lu runs had less than %.1lf%% of the array "
+               "on huge pages, results are INVALID\n", invalid, config.repeat,
+               config.minCoverage);
+    }
+    fflush(out);
+
+    return 0;
+}
+#endif
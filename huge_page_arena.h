@@ -0,0 +1,350 @@
+#ifndef HUGE_PAGE_ARENA_H
+#define HUGE_PAGE_ARENA_H
+
+// Huge page backed memory, the way huge_memory_bench.cpp maps its array, for
+// use outside of the benchmark:
+//
+// - mapMemory() maps a range with the biggest page size it can get, trying
+//   1GiB hugetlbfs pages, then 2MiB ones, then THP (madvise), then 4KiB
+//   pages, starting from Options::kind. The mapping is aligned to 2MiB (or
+//   1GiB for 1GiB pages) so THP can back all of it, optionally bound to NUMA
+//   nodes, and Mapping::kind says what it actually got.
+// - HugePageArena is a bump allocator on top of one such mapping, for long
+//   lived data, and HugePageAllocator puts STL containers in it:
+//
+//     hugepages::HugePageArena arena(1UL << 30);
+//     std::vector<double, hugepages::HugePageAllocator<double>> v(
+//         hugepages::HugePageAllocator<double>(&arena));
+//
+// - readSmaps() tells how much of a range is really on huge pages: THP can
+//   fall back to 4KiB pages page by page without failing anything.
+//
+// hugetlbfs pages come from the pools in /sys/kernel/mm/hugepages, they have
+// to be reserved beforehand (see the README of huge_memory_bench.cpp).
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <linux/mman.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_WRITE
+// Linux 5.14
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace hugepages {
+
+// In fallback order
+enum PageKind { PAGE_1G, PAGE_2M, PAGE_THP, PAGE_4K, NUM_PAGE_KINDS };
+
+static const char * const pageKindNames[] = {"1g", "2m", "thp", "4k"};
+
+inline size_t pageKindBytes(PageKind kind)
+{
+    static const size_t bytes[] = {1UL << 30, 2UL << 20, 2UL << 20, 4096};
+    return bytes[kind];
+}
+
+struct Options {
+    // First kind tried, and with fallback the ones after it in order
+    PageKind kind = PAGE_1G;
+    bool fallback = true;
+    // NUMA nodes the memory is bound to, interleaved if there are several,
+    // the default policy if none
+    std::vector<int> nodes;
+    // Fault every page in before returning
+    bool populate = false;
+    // Don't reserve swap for THP and 4KiB mappings, so a big one only costs
+    // what gets touched. hugetlbfs pages are always reserved at mmap time.
+    bool noReserve = false;
+    // Shared mapping of fd (shm, file, hugetlbfs file) instead of anonymous
+    // memory. There is no fallback then: the fd decides the page size, kind
+    // only says what to madvise.
+    int fd = -1;
+};
+
+struct Mapping {
+    void *addr = nullptr;
+    // Rounded up to the page size of kind
+    size_t size = 0;
+    PageKind kind = PAGE_4K;
+};
+
+// Bind [mem, mem + size) to the given NUMA nodes. A single node uses
+// MPOL_BIND, several nodes interleave the pages between them. Must be called
+// before the memory is touched.
+inline bool bindMemory(void *mem, unsigned long size, const std::vector<int> &nodes)
+{
+    unsigned long mask[16] = {};
+    const unsigned long maxNode = sizeof(mask) * 8;
+    for (int node : nodes) {
+        if ((unsigned long) node >= maxNode) {
+            printf("NUMA node %d is out of range\n", node);
+            return false;
+        }
+        mask[node / 64] |= 1UL << (node % 64);
+    }
+    const int mode = nodes.size() == 1 ? MPOL_BIND : MPOL_INTERLEAVE;
+    // numaif.h would need libnuma, the raw syscall doesn't.
+    if (syscall(SYS_mbind, mem, size, mode, mask, maxNode, 0)) {
+        perror("mbind");
+        return false;
+    }
+    return true;
+}
+
+// One attempt at mapping size bytes with pages of kind at an aligned address
+inline bool mapKind(size_t size, PageKind kind, const Options &options,
+                    Mapping *mapping)
+{
+    const size_t pageBytes = pageKindBytes(kind);
+    const size_t align = pageBytes > (2UL << 20) ? pageBytes : 2UL << 20;
+    const size_t mapSize = (size + pageBytes - 1) / pageBytes * pageBytes;
+
+    // Reserve enough address space to align, keep the aligned part
+    char *reserved = (char *) mmap(nullptr, mapSize + align, PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                   -1, 0);
+    if (reserved == MAP_FAILED)
+        return false;
+    char *addr = (char *) (((uintptr_t) reserved + align - 1) & ~(align - 1));
+    if (addr > reserved)
+        munmap(reserved, addr - reserved);
+    munmap(addr + mapSize, reserved + align - addr);
+
+    const bool hugetlb = kind == PAGE_1G || kind == PAGE_2M;
+    int flags = MAP_FIXED
+              | (options.fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED);
+    if (hugetlb && options.fd < 0)
+        flags |= MAP_HUGETLB | (kind == PAGE_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+    if (!hugetlb && options.noReserve)
+        flags |= MAP_NORESERVE;
+    // MAP_POPULATE faults everything in before we get a chance to madvise
+    // or mbind
+    const bool populateLater = kind == PAGE_THP || !options.nodes.empty();
+    if (options.populate && !populateLater)
+        flags |= MAP_POPULATE;
+    if (mmap(addr, mapSize, PROT_READ | PROT_WRITE, flags, options.fd, 0)
+        == MAP_FAILED) {
+        const int err = errno;
+        munmap(addr, mapSize);
+        errno = err;
+        return false;
+    }
+
+    bool ok = true;
+    if (kind == PAGE_THP) {
+        ok = !madvise(addr, mapSize, MADV_HUGEPAGE);
+    } else if (kind == PAGE_4K) {
+        // Not THP either, even with transparent_hugepage/enabled = always
+        madvise(addr, mapSize, MADV_NOHUGEPAGE);
+    }
+    if (ok && !options.nodes.empty())
+        ok = bindMemory(addr, mapSize, options.nodes);
+    if (ok && options.populate && populateLater)
+        ok = !madvise(addr, mapSize, MADV_POPULATE_WRITE);
+    if (!ok) {
+        const int err = errno;
+        munmap(addr, mapSize);
+        errno = err;
+        return false;
+    }
+    mapping->addr = addr;
+    mapping->size = mapSize;
+    mapping->kind = kind;
+    return true;
+}
+
+// Maps at least size bytes, see Options. False with errno set by the last
+// attempt if no kind worked.
+inline bool mapMemory(size_t size, const Options &options, Mapping *mapping)
+{
+    const int last = options.fallback && options.fd < 0 ? NUM_PAGE_KINDS - 1
+                                                       : options.kind;
+    for (int kind = options.kind; kind <= last; ++kind) {
+        if (mapKind(size, PageKind(kind), options, mapping))
+            return true;
+    }
+    return false;
+}
+
+inline void unmapMemory(Mapping *mapping)
+{
+    if (mapping->addr)
+        munmap(mapping->addr, mapping->size);
+    mapping->addr = nullptr;
+    mapping->size = 0;
+}
+
+// How a range of memory is backed, from /proc/self/smaps, in KiB like smaps.
+struct Residency {
+    // Resident, hugetlbfs pages excluded (smaps doesn't count them in Rss)
+    unsigned long rssKib = 0;
+    // Part of rssKib mapped with PMDs: AnonHugePages, ShmemPmdMapped and
+    // FilePmdMapped
+    unsigned long thpKib = 0;
+    // Private_Hugetlb and Shared_Hugetlb
+    unsigned long hugetlbKib = 0;
+    // False if a mapping only partly overlapped the range, e.g. once the
+    // kernel merged it with a neighbour: smaps only has totals per mapping,
+    // so that one was counted in proportion to the overlap.
+    bool exact = true;
+};
+
+// Sum the smaps entries of the mappings overlapping [addr, addr + size)
+inline bool readSmaps(const void *addr, unsigned long size, Residency *res)
+{
+    std::ifstream ifs("/proc/self/smaps");
+    if (!ifs) {
+        puts("Can't open /proc/self/smaps");
+        return false;
+    }
+    const unsigned long first = (unsigned long) addr;
+    const unsigned long last = first + size;
+    // Part of the current mapping in the range, 1 when it's all inside
+    double share = 0.0;
+    std::string line;
+    while (getline(ifs, line)) {
+        unsigned long start, end;
+        char name[64];
+        unsigned long kib;
+        if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2
+         && line.find(':') > line.find(' ')) {
+            // Header of the next mapping: "start-end perms offset ..."
+            if (start < last && end > first) {
+                const unsigned long overlap = std::min(end, last) - std::max(start, first);
+                share = (double) overlap / (end - start);
+                if (overlap != end - start)
+                    res->exact = false;
+            } else {
+                share = 0.0;
+            }
+        } else if (share > 0.0 && sscanf(line.c_str(), "%63[^:]: %lu kB", name, &kib) == 2) {
+            kib = (unsigned long) (kib * share + 0.5);
+            if (!strcmp(name, "Rss")) {
+                res->rssKib += kib;
+            } else if (!strcmp(name, "AnonHugePages")
+                    || !strcmp(name, "ShmemPmdMapped")
+                    || !strcmp(name, "FilePmdMapped")) {
+                res->thpKib += kib;
+            } else if (!strcmp(name, "Private_Hugetlb")
+                    || !strcmp(name, "Shared_Hugetlb")) {
+                res->hugetlbKib += kib;
+            }
+        }
+    }
+    return true;
+}
+
+// Bump allocator over one mapping of capacity bytes. Nothing is given back
+// before the arena goes away, which is what long lived data wants anyway.
+// With THP or 4KiB pages only the part handed out gets faulted in.
+class HugePageArena {
+  public:
+    explicit HugePageArena(size_t capacity, const Options &options = defaultOptions())
+    {
+        if (!mapMemory(capacity, options, &map))
+            map = Mapping();
+    }
+
+    ~HugePageArena()
+    {
+        unmapMemory(&map);
+    }
+
+    HugePageArena(const HugePageArena &) = delete;
+    HugePageArena &operator=(const HugePageArena &) = delete;
+
+    // False if not even 4KiB pages could be mapped
+    bool valid() const { return map.addr != nullptr; }
+    const Mapping &mapping() const { return map; }
+    PageKind kind() const { return map.kind; }
+    size_t capacity() const { return map.size; }
+    size_t used() const { return top; }
+
+    // Null once the arena is full, align must be a power of 2
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+    {
+        const size_t begin = (top + align - 1) & ~(align - 1);
+        if (!map.addr || begin > map.size || bytes > map.size - begin)
+            return nullptr;
+        top = begin + bytes;
+        return (char *) map.addr + begin;
+    }
+
+    bool owns(const void *p) const
+    {
+        return map.addr && (const char *) p >= (const char *) map.addr
+            && (const char *) p < (const char *) map.addr + map.size;
+    }
+
+    // What the part in use is really backed by
+    bool residency(Residency *res) const
+    {
+        return valid() && readSmaps(map.addr, map.size, res);
+    }
+
+    // Every kind in order, address space only reserved for THP and 4KiB
+    static Options defaultOptions()
+    {
+        Options options;
+        options.noReserve = true;
+        return options;
+    }
+
+  private:
+    Mapping map;
+    size_t top = 0;
+};
+
+// STL allocator handing out memory from an arena, deallocate is a no-op
+template <typename T>
+struct HugePageAllocator {
+    typedef T value_type;
+
+    HugePageArena *arena;
+
+    explicit HugePageAllocator(HugePageArena *arena) : arena(arena) {}
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n)
+    {
+        if (n > size_t(-1) / sizeof(T))
+            throw std::bad_alloc();
+        void *p = arena->allocate(n * sizeof(T), alignof(T));
+        if (!p)
+            throw std::bad_alloc();
+        return (T *) p;
+    }
+
+    void deallocate(T *, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T> &a, const HugePageAllocator<U> &b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T> &a, const HugePageAllocator<U> &b)
+{
+    return a.arena != b.arena;
+}
+
+} // namespace hugepages
+
+#endif